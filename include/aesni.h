@@ -0,0 +1,78 @@
+/* ------------------------------------------------------------------
+ * SC Crypto - AES-NI Kernels Header
+ * ------------------------------------------------------------------ */
+
+#ifndef SC_AESNI_H
+#define SC_AESNI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESNI_NONE                  0
+#define AESNI_BASE                  1
+#define AESNI_VAES256               2
+#define AESNI_VAES512               3
+
+#define AESNI_ROUNDS                14
+#define AESNI_BLOCKLEN              16
+#define AESNI_LANES                 8
+
+/**
+ * AES-256 expanded key
+ */
+struct aesni_key_t
+{
+    uint8_t rk[( AESNI_ROUNDS + 1 ) * AESNI_BLOCKLEN];
+    int level;
+};
+
+/**
+ * Independent CBC chain encrypted alongside others
+ */
+struct aesni_lane_t
+{
+    uint8_t *iv;
+    const uint8_t *src;
+    uint8_t *dst;
+    size_t len;
+};
+
+/**
+ * Detect best AES instruction set supported
+ */
+extern int aesni_detect ( void );
+
+/**
+ * Get AES instruction set name
+ */
+extern const char *aesni_level_name ( int level );
+
+/**
+ * Expand AES-256 encryption key
+ */
+extern int aesni_setkey_enc ( struct aesni_key_t *key, const uint8_t * rawkey, int level );
+
+/**
+ * Expand AES-256 decryption key
+ */
+extern int aesni_setkey_dec ( struct aesni_key_t *key, const uint8_t * rawkey, int level );
+
+/**
+ * Encrypt blocks with AES-256 in CBC mode
+ */
+extern void aesni_cbc_encrypt ( const struct aesni_key_t *key, size_t len, uint8_t * iv,
+    const uint8_t * src, uint8_t * dst );
+
+/**
+ * Encrypt up to AESNI_LANES independent CBC chains at once
+ */
+extern void aesni_cbc_encrypt_lanes ( const struct aesni_key_t *key, struct aesni_lane_t *lanes,
+    int n );
+
+/**
+ * Decrypt blocks with AES-256 in CBC mode
+ */
+extern void aesni_cbc_decrypt ( const struct aesni_key_t *key, size_t len, uint8_t * iv,
+    const uint8_t * src, uint8_t * dst );
+
+#endif
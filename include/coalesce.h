@@ -0,0 +1,30 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Small Read Coalescing Header File
+ * ------------------------------------------------------------------ */
+
+#ifndef SOCKSCRYPT_COALESCE_H
+#define SOCKSCRYPT_COALESCE_H
+
+#include "sockscrypt.h"
+
+/**
+ * Register coalescing timer with the proxy
+ */
+extern int coalesce_attach ( struct proxy_t *proxy );
+
+/**
+ * Watch stream for small reads held back
+ */
+extern void coalesce_track ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Frame small reads whose window has expired
+ */
+extern int coalesce_events ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Stop watching the stream
+ */
+extern void coalesce_release ( struct proxy_t *proxy, struct stream_t *stream );
+
+#endif
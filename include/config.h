@@ -11,10 +11,29 @@
 
 #define SOCKSCRYPT_VERSION          "1.05.1a"
 #define PROGRAM_SHORTCUT            "skcr"
-#define POOL_SIZE                   256
-#define LISTEN_BACKLOG              4
-#define POLL_TIMEOUT_MSEC           16000
+#define STREAM_CHUNK_SIZE           64
+#define RELATION_LIMIT              4096
+#define EVENTS_BATCH_SIZE           256
+#define URING_SQ_ENTRIES            256
+#define URING_CQ_ENTRIES            4096
+#define URING_FILES_MAX             65536
+#define REBALANCE_INTERVAL_MSEC     1000
+#define REBALANCE_MIN_RATE          8388608
+#define PIPELINE_INTERVAL_MSEC      1000
+#define PIPELINE_MIN_RATE           16777216
+#define PIPELINE_RING_SIZE          262144
+#define PIPELINE_THREADS_MAX        64
+#define LISTEN_BACKLOG              1024
+#define ACCEPT_BUDGET               64
+#define POLL_TIMEOUT_MSEC           -1
 #define FORWARD_CHUNK_LEN           16384
+#define COALESCE_BYTES              1024
+#define FORWARD_READ_BUDGET         262144
+#define TIMER_TICK_MSEC             100
+#define CONNECT_TIMEOUT_SEC         10
+#define PEER_TIMEOUT_SEC            60
+#define KEEPALIVE_PROBES            4
+#define RING_BUFFER_SIZE            262144
 #define DATA_QUEUE_CAPACITY         0
 
 #ifndef SOCKSCRYPT_PRESET_KEY
@@ -8,6 +8,9 @@
 #include <mbedtls/entropy.h>
 #include <mbedtls/ctr_drbg.h>
 #include <mbedtls/aes.h>
+#include <mbedtls/gcm.h>
+#include <mbedtls/chachapoly.h>
+#include "aesni.h"
 
 #ifndef FALSE
 #define FALSE 0
@@ -22,6 +25,41 @@
 #define AES256_BLOCKLEN 16
 #define PERS_STRING "SCCrypt"
 #define FS_BLOCKLEN 4096
+#define SC_CACHELINE 64
+#define SC_BENCH_CHUNK 16384
+#define SC_BENCH_MSEC 20
+
+#define SC_AEAD_NONE 0
+#define SC_AEAD_GCM 1
+#define SC_AEAD_CHACHA 2
+#define SC_AEAD_COUNT 3
+#define SC_WIRE_V2 0x02
+#define SC_AEAD_NONCELEN 12
+#define SC_AEAD_TAGLEN 16
+#define SC_RECORD_MAX (2 + 65535 + SC_AEAD_TAGLEN)
+#define SC_RECORD_BUFSIZE (2 * SC_RECORD_MAX)
+#define SC_WIRE_KTLS 0x03
+#define SC_FRAME_SHORT_MAX 65535
+#define SC_FRAME_MAX 16777216
+#define SC_KTLS_HELLOLEN (2 * AES256_BLOCKLEN)
+#define SC_KTLS_SALTLEN 4
+#define SC_KTLS_IVLEN 8
+
+#ifndef SC_NONCE_POOL_SIZE
+#define SC_NONCE_POOL_SIZE 256
+#endif
+
+/**
+ * SC pre-generated nonce pool
+ */
+struct sc_nonce_pool_t
+{
+    int avail;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long refills;
+    uint8_t nonces[SC_NONCE_POOL_SIZE][AES256_BLOCKLEN];
+};
 
 /**
  * SC random generator
@@ -33,6 +71,35 @@ struct sc_random_t
     mbedtls_entropy_context entropy;
 };
 
+struct sc_context_t;
+struct sc_stream_t;
+
+/**
+ * SC cipher backend
+ */
+struct sc_engine_t
+{
+    const char *name;
+    int level;
+    int ( *setup ) ( struct sc_context_t * context, const struct sc_engine_t * engine );
+    int ( *crypt ) ( struct sc_stream_t * stream, int len, const uint8_t * src, uint8_t * dst );
+    void ( *release ) ( struct sc_stream_t * stream );
+    void ( *encrypt_lanes ) ( const struct sc_context_t * context, struct aesni_lane_t * lanes,
+        int n );
+};
+
+#define SC_BATCH_SIZE AESNI_LANES
+
+/**
+ * Frames of several streams waiting to be encrypted together
+ */
+struct sc_batch_t
+{
+    int count;
+    struct sc_stream_t *streams[SC_BATCH_SIZE];
+    struct aesni_lane_t lanes[SC_BATCH_SIZE];
+};
+
 /**
  * SC context structure
  */
@@ -40,8 +107,27 @@ struct sc_context_t
 {
     int initialized;
     int derive_n_rounds;
+    int ring_size;
+    int chunk_len;
+    int coalesce_usec;
+    int coalesce_bytes;
+    const struct sc_engine_t *engine;
+    int aead;
+    struct sc_batch_t batch;
     struct sc_random_t random;
+    struct sc_nonce_pool_t nonce_pool;
     uint8_t aeskey[AES256_KEYLEN];
+
+    /* Wire v2 markers and subkeys, derived from the AES key */
+    uint8_t aead_marker[SC_AEAD_COUNT][AES256_BLOCKLEN];
+    uint8_t aead_key[SC_AEAD_COUNT][AES256_KEYLEN];
+    uint8_t ktls_marker[AES256_BLOCKLEN];
+
+    /* Round keys shared read-only by all streams */
+    mbedtls_aes_context aes_enc __attribute__ ( ( aligned ( SC_CACHELINE ) ) );
+    mbedtls_aes_context aes_dec __attribute__ ( ( aligned ( SC_CACHELINE ) ) );
+    struct aesni_key_t aesni_enc __attribute__ ( ( aligned ( SC_CACHELINE ) ) );
+    struct aesni_key_t aesni_dec __attribute__ ( ( aligned ( SC_CACHELINE ) ) );
 };
 
 #define SC_STREAM_INITIALIZED      1
@@ -49,6 +135,11 @@ struct sc_context_t
 #define SC_STREAM_ENCRYPT_MODE     4
 #define SC_STREAM_SENT_TXNONCE     8
 #define SC_STREAM_RECV_RXNONCE     16
+#define SC_STREAM_RECV_RXSALT      32
+#define SC_STREAM_BATCHED          64
+#define SC_STREAM_DEFERRED         128
+#define SC_STREAM_JUMBO            256
+#define SC_STREAM_HOLDING          512
 
 /**
  * SC stream context
@@ -56,14 +147,31 @@ struct sc_context_t
 struct sc_stream_t
 {
     int flags;
-    mbedtls_aes_context aes;
+    struct sc_context_t *context;
     uint8_t iv[AES256_BLOCKLEN];
     int expected_len;
     uint8_t unconsumed[AES256_BLOCKLEN];
     int unconsumed_len;
-    uint8_t *processed;
-    int processed_size;
-    int processed_len;
+    const struct sc_engine_t *engine;
+    void *engine_ctx;
+    int aead;
+    void *aead_ctx;
+    uint8_t salt[SC_AEAD_NONCELEN];
+    uint64_t seq;
+    uint8_t *record;
+    int record_len;
+    uint8_t *pending;
+    int pending_len;
+    uint64_t pending_usec;
+    uint64_t small_usec;
+    unsigned long long plain_bytes;
+    unsigned long long wire_bytes;
+    uint8_t *ring;
+    int ring_size;
+    int ring_head;
+    int ring_tail;
+    int ring_wrap;
+    int ring_hiwat;
 };
 
 /**
@@ -76,15 +184,114 @@ extern int sc_init ( struct sc_context_t *context, const uint8_t * key, size_t k
  */
 extern void sc_free ( struct sc_context_t *context );
 
+/**
+ * Refill nonce pool if running low
+ */
+extern int sc_refill_nonces ( struct sc_context_t *context );
+
+/**
+ * Get AES implementation name
+ */
+extern const char *sc_engine_name ( const struct sc_context_t *context );
+
+/**
+ * Get AES implementation by index
+ */
+extern const struct sc_engine_t *sc_engine_at ( size_t index );
+
+/**
+ * Find AES implementation by name
+ */
+extern const struct sc_engine_t *sc_engine_find ( const char *name );
+
+/**
+ * Switch context to AES implementation
+ */
+extern int sc_engine_select ( struct sc_context_t *context, const struct sc_engine_t *engine );
+
+/**
+ * Measure AES implementation throughput
+ */
+extern int sc_engine_benchmark ( struct sc_context_t *context, const struct sc_engine_t *engine,
+    unsigned long *rate );
+
+/**
+ * Find wire cipher by name
+ */
+extern int sc_aead_find ( const char *name );
+
+/**
+ * Get wire cipher name
+ */
+extern const char *sc_aead_name ( int aead );
+
+/**
+ * Build kernel TLS hello and derive its sending key
+ */
+extern int sc_ktls_hello ( struct sc_context_t *context, uint8_t * hello, uint8_t * key,
+    uint8_t * iv );
+
+/**
+ * Check kernel TLS hello and derive its receiving key
+ */
+extern int sc_ktls_accept ( const struct sc_context_t *context, const uint8_t * hello,
+    uint8_t * key, uint8_t * iv );
+
 /**
  * Create new SC stream
  */
 extern int sc_new_stream ( struct sc_stream_t *stream, struct sc_context_t *context, int encrypt );
 
 /**
- * Process traffic data
+ * Get buffer for incoming traffic data
+ */
+extern uint8_t *sc_input_buffer ( struct sc_stream_t *stream, int *len );
+
+/**
+ * Process traffic data in place
+ */
+extern int sc_process_data ( struct sc_stream_t *stream, int len );
+
+/**
+ * Process traffic data from the event loop, small reads may be held back
+ * and encryption may wait for sc_batch_flush
+ */
+extern int sc_process_batched ( struct sc_stream_t *stream, int len );
+
+/**
+ * Frame small reads held back by the stream
+ */
+extern int sc_flush_pending ( struct sc_stream_t *stream );
+
+/**
+ * Get monotonic time in microseconds
+ */
+extern uint64_t sc_clock_usec ( void );
+
+/**
+ * Encrypt all frames waiting in the batch
+ */
+extern void sc_batch_flush ( struct sc_context_t *context );
+
+/**
+ * Get processed data ready to be sent
+ */
+extern uint8_t *sc_output_data ( struct sc_stream_t *stream, int *len );
+
+/**
+ * Get processed data wrapped around to the ring start
+ */
+extern uint8_t *sc_output_wrapped ( struct sc_stream_t *stream, int *len );
+
+/**
+ * Mark processed data as sent, possibly past the wrap point
+ */
+extern void sc_consume_data ( struct sc_stream_t *stream, int len );
+
+/**
+ * Check if processed data is pending
  */
-extern int sc_process_data ( struct sc_stream_t *stream, const uint8_t * src, int len );
+extern int sc_has_output ( const struct sc_stream_t *stream );
 
 /**
  * Uninitialize SC stream
@@ -0,0 +1,33 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Kernel TLS Offload Header File
+ * ------------------------------------------------------------------ */
+
+#ifndef SOCKSCRYPT_KTLS_H
+#define SOCKSCRYPT_KTLS_H
+
+#include "sockscrypt.h"
+
+#define KTLS_PROBE                  1
+#define KTLS_SPLICE                 2
+
+/**
+ * Start kernel TLS on a freshly bound relation
+ */
+extern int ktls_bind ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Receive data on a kernel TLS aware stream
+ */
+extern int ktls_receive ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Send data spliced from the neighbour stream
+ */
+extern int ktls_splice_out ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Release kernel TLS state of the stream
+ */
+extern void ktls_release ( struct stream_t *stream );
+
+#endif
@@ -0,0 +1,157 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Crypto Pipeline Header File
+ * ------------------------------------------------------------------ */
+
+#ifndef SOCKSCRYPT_PIPELINE_H
+#define SOCKSCRYPT_PIPELINE_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "sockscrypt.h"
+
+/**
+ * Single-producer single-consumer byte ring
+ */
+struct spsc_ring_t
+{
+    uint8_t *buf;
+    size_t size;
+
+    /* Written by consumer only */
+    size_t head __attribute__ ( ( aligned ( SC_CACHELINE ) ) );
+
+    /* Written by producer only */
+    size_t tail __attribute__ ( ( aligned ( SC_CACHELINE ) ) );
+};
+
+/**
+ * Crypto pipeline of a single stream direction
+ */
+struct pipe_t
+{
+    /* Raw data from socket, filled by event loop */
+    struct spsc_ring_t input;
+
+    /* Processed data for neighbour, filled by crypto thread */
+    struct spsc_ring_t output;
+
+    /* Input bytes still in stream ring, released once moved to output */
+    size_t held;
+
+    int error;
+    struct stream_t *stream;
+    struct pipe_loop_t *loop;
+    struct pipe_thread_t *thread;
+    struct pipe_t *thread_next;
+    struct pipe_t *loop_prev;
+    struct pipe_t *loop_next;
+};
+
+/**
+ * Event loop side of the pipeline
+ */
+struct pipe_loop_t
+{
+    int event_fd;
+    int notified;
+    struct timespec last_tick;
+    struct stream_t *event_stream;
+    struct pipe_t *head;
+};
+
+/**
+ * Crypto worker thread
+ */
+struct pipe_thread_t
+{
+    int index;
+    int stop;
+    int sleeping;
+    size_t npipes;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct pipe_t *head;
+} __attribute__ ( ( aligned ( SC_CACHELINE ) ) );
+
+/**
+ * Crypto worker thread pool
+ */
+struct pipeline_t
+{
+    int nthreads;
+    struct pipe_thread_t *threads;
+};
+
+/**
+ * Start crypto worker threads
+ */
+extern struct pipeline_t *pipeline_start ( int nthreads );
+
+/**
+ * Stop crypto worker threads
+ */
+extern void pipeline_stop ( struct pipeline_t *pipeline );
+
+/**
+ * Register pipeline events with the proxy
+ */
+extern int pipeline_attach ( struct proxy_t *proxy );
+
+/**
+ * Unregister pipeline events from the proxy
+ */
+extern void pipeline_detach ( struct proxy_t *proxy );
+
+/**
+ * Move crypto of fast relations to worker threads
+ */
+extern void pipeline_check ( struct proxy_t *proxy );
+
+/**
+ * Handle pipeline progress reported by worker threads
+ */
+extern int pipeline_events ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Release stream pipeline
+ */
+extern void pipe_release ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Get room for raw socket data
+ */
+extern uint8_t *pipe_input_buffer ( struct pipe_t *pipe, int *len );
+
+/**
+ * Pass raw socket data to worker thread
+ */
+extern void pipe_input_commit ( struct pipe_t *pipe, int len );
+
+/**
+ * Get processed data ready to be sent
+ */
+extern uint8_t *pipe_output_data ( struct pipe_t *pipe, int *len );
+
+/**
+ * Get processed data wrapped around to the ring start
+ */
+extern uint8_t *pipe_output_wrapped ( struct pipe_t *pipe, int *len );
+
+/**
+ * Mark processed data as sent
+ */
+extern void pipe_output_consume ( struct pipe_t *pipe, int len );
+
+/**
+ * Check if processed data is pending
+ */
+extern int pipe_has_output ( struct pipe_t *pipe );
+
+/**
+ * Check if raw data is still being processed or waits to be sent
+ */
+extern int pipe_has_pending ( struct pipe_t *pipe );
+
+#endif
@@ -10,6 +10,10 @@
 #include "crypto.h"
 
 #define L_ACCEPT                    0
+#define L_HANDOFF                   1
+#define L_PIPELINE                  2
+#define L_COALESCE                  3
+#define L_TIMER                     4
 
 #define LEVEL_AWAITING              1
 
@@ -22,6 +26,17 @@ struct queue_t
     uint8_t arr[DATA_QUEUE_CAPACITY];
 };
 
+/**
+ * Timer wheel entry
+ */
+struct wheel_timer_t
+{
+    uint64_t expires;
+    struct wheel_timer_t *next;
+    struct wheel_timer_t **pprev;
+    struct wheel_t *wheel;
+};
+
 /**
  * IP/TCP connection stream
  */
@@ -32,17 +47,50 @@ struct stream_t
     int level;
     int allocated;
     int abandoned;
+    int scheduled;
     short events;
-    short levents;
+    short lrevents;
     short revents;
 
     struct pollfd *pollref;
+    unsigned int uring_gen;
+    int uring_ops;
+    int uring_done;
+    int uring_recv_res;
+    int uring_send_res;
+    uint8_t *uring_recv_buf;
+    struct iovec uring_iov[2];
+    struct msghdr uring_msg;
     struct stream_t *neighbour;
     struct stream_t *prev;
     struct stream_t *next;
+    struct stream_t *ready_prev;
+    struct stream_t *ready_next;
+    struct stream_t *lru_prev;
+    struct stream_t *lru_next;
     struct queue_t queue;
 
     struct sc_stream_t sc;
+    unsigned long nsyscalls;
+    unsigned long long nbytes;
+    unsigned long long nbytes_mark;
+    unsigned long long nbytes_in;
+    unsigned long long nbytes_in_mark;
+    struct pipe_t *pipe;
+    int ktls;
+    int hello_len;
+    uint8_t hello[SC_KTLS_HELLOLEN];
+    int splice_fds[2];
+    int splice_len;
+    int corked;
+    int eof;
+    int shut;
+    int coalescing;
+    uint64_t coalesce_deadline;
+    struct stream_t *coalesce_prev;
+    struct stream_t *coalesce_next;
+    struct wheel_timer_t timer;
+    unsigned long long idle_mark;
 };
 
 /**
@@ -53,11 +101,47 @@ struct proxy_t
     size_t stream_size;
     int verbose;
     int epoll_fd;
+    int reuse_port;
+    int listen_backlog;
     struct stream_t *stream_head;
     struct stream_t *stream_tail;
-    struct stream_t stream_pool[POOL_SIZE];
+    struct stream_t *ready_head;
+    struct stream_t *ready_tail;
+    size_t ready_len;
+    struct stream_t *lru_head;
+    struct stream_t *lru_tail;
+    struct stream_t *stream_free;
+    struct stream_chunk_t *stream_chunks;
+    size_t stream_count;
+    size_t stream_capacity;
+    size_t stream_limit;
+    struct pollfd *poll_list;
+    size_t poll_size;
+    int use_uring;
+    unsigned int uring_seq;
+    struct uring_t *uring;
 
     int client_side_mode;
+    int listen_sock;
+    unsigned long long nbytes;
+    struct worker_t *worker;
+    struct pipeline_t *pipeline;
+    struct pipe_loop_t *pipe_loop;
+    int use_ktls;
+    struct stream_t *coalesce_timer;
+    struct stream_t *coalesce_head;
+    struct stream_t *coalesce_tail;
+    uint64_t coalesce_armed;
+    struct wheel_t *wheel;
+    int connect_timeout;
+    int idle_timeout;
+    int peer_timeout;
+    struct stream_t *accept_stream;
+    int *park;
+    int park_limit;
+    int park_size;
+    int park_head;
+    int park_len;
 
     struct sockaddr_storage entrance;
     struct sockaddr_storage endpoint;
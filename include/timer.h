@@ -0,0 +1,58 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Timer Wheel Header File
+ * ------------------------------------------------------------------ */
+
+#ifndef SOCKSCRYPT_TIMER_H
+#define SOCKSCRYPT_TIMER_H
+
+#include "sockscrypt.h"
+
+#define WHEEL_BITS                  8
+#define WHEEL_SLOTS                 (1 << WHEEL_BITS)
+#define WHEEL_MASK                  (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS                3
+
+/**
+ * Hierarchical timer wheel, each level slot spans a whole lower level
+ */
+struct wheel_t
+{
+    uint64_t tick;
+    uint64_t origin_msec;
+    uint64_t armed;
+    size_t count;
+    struct stream_t *event_stream;
+    struct wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/**
+ * Register timer wheel with the proxy
+ */
+extern int timer_attach ( struct proxy_t *proxy );
+
+/**
+ * Unregister timer wheel from the proxy
+ */
+extern void timer_detach ( struct proxy_t *proxy );
+
+/**
+ * Arm connect or idle timeout of the relation, by stream level
+ */
+extern void timer_track ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Let the kernel detect dead peers of the socket
+ */
+extern void timer_keepalive ( struct proxy_t *proxy, int sock );
+
+/**
+ * Handle expired timeouts
+ */
+extern int timer_events ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Cancel stream timeout
+ */
+extern void timer_release ( struct stream_t *stream );
+
+#endif
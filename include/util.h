@@ -34,6 +34,8 @@
 #define LEVEL_CONNECTING            111
 #define LEVEL_FORWARDING            123
 #define EPOLLREF                    ((struct pollfd*) -1)
+#define URING_OP_RECV               1
+#define URING_OP_SEND               2
 #define STRADDR_SIZE                (INET_ADDRSTRLEN + INET6_ADDRSTRLEN + 16)
 
 /**
@@ -88,14 +90,27 @@ struct stream_t
     int level;
     int allocated;
     int abandoned;
+    int scheduled;
     short events;
-    short levents;
+    short lrevents;
     short revents;
 
     struct pollfd *pollref;
+    unsigned int uring_gen;
+    int uring_ops;
+    int uring_done;
+    int uring_recv_res;
+    int uring_send_res;
+    uint8_t *uring_recv_buf;
+    struct iovec uring_iov[2];
+    struct msghdr uring_msg;
     struct stream_t *neighbour;
     struct stream_t *prev;
     struct stream_t *next;
+    struct stream_t *ready_prev;
+    struct stream_t *ready_next;
+    struct stream_t *lru_prev;
+    struct stream_t *lru_next;
     struct queue_t queue;
 
     /* additional params here */
@@ -109,9 +124,25 @@ struct proxy_t
     size_t stream_size;
     int verbose;
     int epoll_fd;
+    int reuse_port;
+    int listen_backlog;
     struct stream_t *stream_head;
     struct stream_t *stream_tail;
-    struct stream_t stream_pool[POOL_SIZE];
+    struct stream_t *ready_head;
+    struct stream_t *ready_tail;
+    size_t ready_len;
+    struct stream_t *lru_head;
+    struct stream_t *lru_tail;
+    struct stream_t *stream_free;
+    struct stream_chunk_t *stream_chunks;
+    size_t stream_count;
+    size_t stream_capacity;
+    size_t stream_limit;
+    struct pollfd *poll_list;
+    size_t poll_size;
+    int use_uring;
+    unsigned int uring_seq;
+    struct uring_t *uring;
 
     /* additional params here */
 };
@@ -121,6 +152,11 @@ struct proxy_t
  */
 extern int handle_stream_events ( struct proxy_t *proxy, struct stream_t *stream );
 
+/**
+ * Release stream resources
+ */
+extern void handle_stream_release ( struct proxy_t *proxy, struct stream_t *stream );
+
 #endif
 /* ------------------------------------------------------------------
  * Proxy Util - Source File
@@ -164,11 +200,6 @@ extern int socket_has_error ( int sock );
  */
 extern int socket_set_nonblocking ( struct proxy_t *proxy, int sock );
 
-/**
- * Forward data between sockets
- */
-extern int socket_forward_data ( struct proxy_t *proxy, int srcfd, int dstfd );
-
 /**
  * Shutdown and close the socket
  */
@@ -208,6 +239,26 @@ extern int check_enough_data ( struct proxy_t *proxy, struct stream_t *stream, s
  */
 extern int proxy_events_setup ( struct proxy_t *proxy );
 
+/**
+ * Release proxy events listenning
+ */
+extern void proxy_events_close ( struct proxy_t *proxy );
+
+/**
+ * Append stream to the ready list
+ */
+extern void schedule_stream ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Move relation to the front of the eviction order
+ */
+extern void touch_stream ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Clear latched readiness once socket would block
+ */
+extern void stream_would_block ( struct stream_t *stream, short events );
+
 /**
  * Build stream event list with poll
  */
@@ -234,12 +285,7 @@ extern int poll_to_epoll_events ( int poll_events );
 extern int epoll_to_poll_events ( int epoll_events );
 
 /**
- * Build stream event list with epoll
- */
-extern int build_epoll_list ( struct proxy_t *proxy );
-
-/**
- * Update streams revents with poll
+ * Update streams revents with epoll
  */
 extern void update_revents_epoll ( struct proxy_t *proxy, int nfds, struct epoll_event *events );
 
@@ -248,6 +294,28 @@ extern void update_revents_epoll ( struct proxy_t *proxy, int nfds, struct epoll
  */
 extern int watch_streams_epoll ( struct proxy_t *proxy );
 
+/**
+ * Watch stream events with io_uring
+ */
+extern int watch_streams_uring ( struct proxy_t *proxy );
+
+/**
+ * Stop watching stream events
+ */
+extern void unwatch_stream ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Queue receive into the buffer with io_uring
+ */
+extern int stream_queue_recv ( struct proxy_t *proxy, struct stream_t *stream, uint8_t * buffer,
+    int len );
+
+/**
+ * Queue send of the iovec with io_uring
+ */
+extern int stream_queue_send ( struct proxy_t *proxy, struct stream_t *stream,
+    const struct iovec *iov, int iovcnt, int flags );
+
 /**
  * Watch stream events
  */
@@ -255,6 +323,11 @@ extern int watch_streams ( struct proxy_t *proxy );
 
 /* NOTE: Stream Related Functions */
 
+/**
+ * Ensure free stream slots are available
+ */
+extern int reserve_streams ( struct proxy_t *proxy, size_t count );
+
 /**
  * Insert new stream structure into the list
  */
@@ -265,11 +338,6 @@ extern struct stream_t *insert_stream ( struct proxy_t *proxy, int sock );
  */
 extern struct stream_t *accept_new_stream ( struct proxy_t *proxy, int lfd );
 
-/**
- * Handle stream data forward
- */
-extern int handle_forward_data ( struct proxy_t *proxy, struct stream_t *stream );
-
 /**
  * Show relations statistics
  */
@@ -290,6 +358,11 @@ extern void remove_relation ( struct stream_t *stream );
  */
 extern void remove_all_streams ( struct proxy_t *proxy );
 
+/**
+ * Free stream slab memory
+ */
+extern void free_streams ( struct proxy_t *proxy );
+
 /**
  * Remove pending streams
  */
@@ -299,7 +372,7 @@ extern void remove_all_streams ( struct proxy_t *proxy );
  */
 
 /**
- * Remove oldest forwarding relation
+ * Remove least recently active relation
  */
 extern void force_cleanup ( struct proxy_t *proxy, const struct stream_t *excl );
 
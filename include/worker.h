@@ -0,0 +1,76 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Worker Threads Header File
+ * ------------------------------------------------------------------ */
+
+#ifndef SOCKSCRYPT_WORKER_H
+#define SOCKSCRYPT_WORKER_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "sockscrypt.h"
+
+#define WORKERS_MAX                 256
+
+/**
+ * Relation handed off between workers
+ */
+struct handoff_t
+{
+    struct handoff_t *next;
+    struct stream_t pair[2];
+};
+
+/**
+ * Event loop worker thread
+ */
+struct worker_t
+{
+    int index;
+    int cpu;
+    int status;
+    int alive;
+    int balance;
+    int nworkers;
+    int listen_sock;
+    int handoff_fd;
+    pthread_t thread;
+
+    unsigned long long last_bytes;
+    struct timespec last_tick;
+    struct stream_t *handoff_stream;
+
+    const struct proxy_t *params;
+    struct worker_t *group;
+
+    /* Written by other workers */
+    unsigned long rate __attribute__ ( ( aligned ( SC_CACHELINE ) ) );
+    struct handoff_t *handoff_head;
+} __attribute__ ( ( aligned ( SC_CACHELINE ) ) );
+
+/**
+ * Run proxy task in parallel worker threads
+ */
+extern int proxy_workers ( struct proxy_t *params, int nworkers, int pin, int balance );
+
+/**
+ * Register worker hand-off queue with the proxy
+ */
+extern int worker_attach ( struct proxy_t *proxy );
+
+/**
+ * Unregister worker hand-off queue from the proxy
+ */
+extern void worker_detach ( struct proxy_t *proxy );
+
+/**
+ * Adopt relations handed off by other workers
+ */
+extern int worker_adopt ( struct proxy_t *proxy, struct stream_t *stream );
+
+/**
+ * Hand off busiest relation if this worker is overloaded
+ */
+extern void worker_rebalance ( struct proxy_t *proxy );
+
+#endif
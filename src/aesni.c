@@ -0,0 +1,710 @@
+/* ------------------------------------------------------------------
+ * SC Crypto - AES-NI Kernels Source
+ * ------------------------------------------------------------------ */
+
+#include <string.h>
+#include "config.h"
+#include "aesni.h"
+
+#if defined(SOCKSCRYPT_AESNI) && ( defined(__x86_64__) || defined(__i386__) )
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define AESNI_TARGET __attribute__ ((target ("sse2,aes")))
+#define VAES256_TARGET __attribute__ ((target ("avx2,aes,vaes")))
+#define VAES512_TARGET __attribute__ ((target ("avx512f,aes,vaes")))
+
+/**
+ * Read extended control register
+ */
+static uint64_t aesni_xgetbv ( void )
+{
+    uint32_t eax;
+    uint32_t edx;
+
+    __asm__ volatile ( "xgetbv":"=a" ( eax ), "=d" ( edx ):"c" ( 0 ) );
+
+    return ( ( uint64_t ) edx << 32 ) | eax;
+}
+
+/**
+ * Detect best AES instruction set supported
+ */
+int aesni_detect ( void )
+{
+    unsigned int eax;
+    unsigned int ebx;
+    unsigned int ecx;
+    unsigned int edx;
+    uint64_t xcr0 = 0;
+
+    if ( !__get_cpuid ( 1, &eax, &ebx, &ecx, &edx ) || ~ecx & bit_AES || ~edx & bit_SSE2 )
+    {
+        return AESNI_NONE;
+    }
+
+    /* Wide registers are usable only if enabled by the kernel */
+    if ( ecx & bit_OSXSAVE )
+    {
+        xcr0 = aesni_xgetbv (  );
+    }
+
+    if ( !__get_cpuid_count ( 7, 0, &eax, &ebx, &ecx, &edx ) || ~ecx & bit_VAES )
+    {
+        return AESNI_BASE;
+    }
+
+    if ( ebx & bit_AVX512F && ( xcr0 & 0xe6 ) == 0xe6 )
+    {
+        return AESNI_VAES512;
+    }
+
+    if ( ebx & bit_AVX2 && ( xcr0 & 0x06 ) == 0x06 )
+    {
+        return AESNI_VAES256;
+    }
+
+    return AESNI_BASE;
+}
+
+/**
+ * Get AES instruction set name
+ */
+const char *aesni_level_name ( int level )
+{
+    switch ( level )
+    {
+    case AESNI_BASE:
+        return "aes-ni";
+    case AESNI_VAES256:
+        return "vaes-256";
+    case AESNI_VAES512:
+        return "vaes-512";
+    }
+
+    return "none";
+}
+
+/**
+ * Expand one AES-256 key schedule step
+ */
+#define AESNI_EXPAND_STEP(A, B, RK, RCON) \
+    { \
+        __m128i t; \
+        t = _mm_shuffle_epi32 ( _mm_aeskeygenassist_si128 ( B, RCON ), 0xff ); \
+        A = _mm_xor_si128 ( A, _mm_slli_si128 ( A, 4 ) ); \
+        A = _mm_xor_si128 ( A, _mm_slli_si128 ( A, 4 ) ); \
+        A = _mm_xor_si128 ( A, _mm_slli_si128 ( A, 4 ) ); \
+        A = _mm_xor_si128 ( A, t ); \
+        _mm_storeu_si128 ( RK, A ); \
+    }
+
+#define AESNI_EXPAND_ODD(A, B, RK) \
+    { \
+        __m128i t; \
+        t = _mm_shuffle_epi32 ( _mm_aeskeygenassist_si128 ( A, 0x00 ), 0xaa ); \
+        B = _mm_xor_si128 ( B, _mm_slli_si128 ( B, 4 ) ); \
+        B = _mm_xor_si128 ( B, _mm_slli_si128 ( B, 4 ) ); \
+        B = _mm_xor_si128 ( B, _mm_slli_si128 ( B, 4 ) ); \
+        B = _mm_xor_si128 ( B, t ); \
+        _mm_storeu_si128 ( RK, B ); \
+    }
+
+/**
+ * Expand AES-256 encryption round keys
+ */
+static AESNI_TARGET void aesni_expand_key ( __m128i * rk, const uint8_t * rawkey )
+{
+    __m128i a;
+    __m128i b;
+
+    a = _mm_loadu_si128 ( ( const __m128i * ) rawkey );
+    b = _mm_loadu_si128 ( ( const __m128i * ) ( rawkey + AESNI_BLOCKLEN ) );
+    _mm_storeu_si128 ( rk + 0, a );
+    _mm_storeu_si128 ( rk + 1, b );
+
+    AESNI_EXPAND_STEP ( a, b, rk + 2, 0x01 );
+    AESNI_EXPAND_ODD ( a, b, rk + 3 );
+    AESNI_EXPAND_STEP ( a, b, rk + 4, 0x02 );
+    AESNI_EXPAND_ODD ( a, b, rk + 5 );
+    AESNI_EXPAND_STEP ( a, b, rk + 6, 0x04 );
+    AESNI_EXPAND_ODD ( a, b, rk + 7 );
+    AESNI_EXPAND_STEP ( a, b, rk + 8, 0x08 );
+    AESNI_EXPAND_ODD ( a, b, rk + 9 );
+    AESNI_EXPAND_STEP ( a, b, rk + 10, 0x10 );
+    AESNI_EXPAND_ODD ( a, b, rk + 11 );
+    AESNI_EXPAND_STEP ( a, b, rk + 12, 0x20 );
+    AESNI_EXPAND_ODD ( a, b, rk + 13 );
+    AESNI_EXPAND_STEP ( a, b, rk + 14, 0x40 );
+}
+
+/**
+ * Convert encryption round keys for the equivalent inverse cipher
+ */
+static AESNI_TARGET void aesni_invert_key ( __m128i * dk, const __m128i * rk )
+{
+    int i;
+
+    _mm_storeu_si128 ( dk, _mm_loadu_si128 ( rk + AESNI_ROUNDS ) );
+
+    for ( i = 1; i < AESNI_ROUNDS; i++ )
+    {
+        _mm_storeu_si128 ( dk + i, _mm_aesimc_si128 ( _mm_loadu_si128 ( rk + AESNI_ROUNDS - i ) ) );
+    }
+
+    _mm_storeu_si128 ( dk + AESNI_ROUNDS, _mm_loadu_si128 ( rk ) );
+}
+
+/**
+ * Expand AES-256 encryption key
+ */
+int aesni_setkey_enc ( struct aesni_key_t *key, const uint8_t * rawkey, int level )
+{
+    if ( level == AESNI_NONE )
+    {
+        return -1;
+    }
+
+    aesni_expand_key ( ( __m128i * ) key->rk, rawkey );
+    key->level = level;
+
+    return 0;
+}
+
+/**
+ * Expand AES-256 decryption key
+ */
+int aesni_setkey_dec ( struct aesni_key_t *key, const uint8_t * rawkey, int level )
+{
+    __m128i rk[AESNI_ROUNDS + 1];
+
+    if ( level == AESNI_NONE )
+    {
+        return -1;
+    }
+
+    aesni_expand_key ( rk, rawkey );
+    aesni_invert_key ( ( __m128i * ) key->rk, rk );
+    memset ( rk, '\0', sizeof ( rk ) );
+    key->level = level;
+
+    return 0;
+}
+
+/**
+ * Encrypt blocks with AES-256 in CBC mode
+ */
+static AESNI_TARGET void aesni_cbc_encrypt_base ( const struct aesni_key_t *key, size_t len,
+    uint8_t * iv, const uint8_t * src, uint8_t * dst )
+{
+    const __m128i *rk = ( const __m128i * ) key->rk;
+    __m128i k0 = _mm_loadu_si128 ( rk + 0 );
+    __m128i k1 = _mm_loadu_si128 ( rk + 1 );
+    __m128i k2 = _mm_loadu_si128 ( rk + 2 );
+    __m128i k3 = _mm_loadu_si128 ( rk + 3 );
+    __m128i k4 = _mm_loadu_si128 ( rk + 4 );
+    __m128i k5 = _mm_loadu_si128 ( rk + 5 );
+    __m128i k6 = _mm_loadu_si128 ( rk + 6 );
+    __m128i k7 = _mm_loadu_si128 ( rk + 7 );
+    __m128i k8 = _mm_loadu_si128 ( rk + 8 );
+    __m128i k9 = _mm_loadu_si128 ( rk + 9 );
+    __m128i k10 = _mm_loadu_si128 ( rk + 10 );
+    __m128i k11 = _mm_loadu_si128 ( rk + 11 );
+    __m128i k12 = _mm_loadu_si128 ( rk + 12 );
+    __m128i k13 = _mm_loadu_si128 ( rk + 13 );
+    __m128i k14 = _mm_loadu_si128 ( rk + 14 );
+    __m128i b = _mm_loadu_si128 ( ( const __m128i * ) iv );
+
+    for ( ; len >= AESNI_BLOCKLEN; len -= AESNI_BLOCKLEN )
+    {
+        b = _mm_xor_si128 ( b, _mm_loadu_si128 ( ( const __m128i * ) src ) );
+        b = _mm_xor_si128 ( b, k0 );
+        b = _mm_aesenc_si128 ( b, k1 );
+        b = _mm_aesenc_si128 ( b, k2 );
+        b = _mm_aesenc_si128 ( b, k3 );
+        b = _mm_aesenc_si128 ( b, k4 );
+        b = _mm_aesenc_si128 ( b, k5 );
+        b = _mm_aesenc_si128 ( b, k6 );
+        b = _mm_aesenc_si128 ( b, k7 );
+        b = _mm_aesenc_si128 ( b, k8 );
+        b = _mm_aesenc_si128 ( b, k9 );
+        b = _mm_aesenc_si128 ( b, k10 );
+        b = _mm_aesenc_si128 ( b, k11 );
+        b = _mm_aesenc_si128 ( b, k12 );
+        b = _mm_aesenc_si128 ( b, k13 );
+        b = _mm_aesenclast_si128 ( b, k14 );
+        _mm_storeu_si128 ( ( __m128i * ) dst, b );
+        src += AESNI_BLOCKLEN;
+        dst += AESNI_BLOCKLEN;
+    }
+
+    _mm_storeu_si128 ( ( __m128i * ) iv, b );
+}
+
+/**
+ * Run a fixed number of CBC chains side by side, kept in registers once inlined
+ */
+static inline __attribute__ ( ( always_inline ) ) AESNI_TARGET void aesni_cbc_encrypt_group (
+    const __m128i * k, __m128i * x, const uint8_t ** src, uint8_t ** dst, size_t blocks,
+    const int w )
+{
+    int j;
+    int r;
+    size_t off;
+    __m128i s[AESNI_LANES];
+
+    for ( j = 0; j < w; j++ )
+    {
+        s[j] = x[j];
+    }
+
+    for ( off = 0; off < blocks * AESNI_BLOCKLEN; off += AESNI_BLOCKLEN )
+    {
+#pragma GCC unroll 8
+        for ( j = 0; j < w; j++ )
+        {
+            s[j] = _mm_xor_si128 ( s[j], _mm_loadu_si128 ( ( const __m128i * ) ( src[j] + off ) ) );
+            s[j] = _mm_xor_si128 ( s[j], k[0] );
+        }
+
+#pragma GCC unroll 14
+        for ( r = 1; r < AESNI_ROUNDS; r++ )
+        {
+#pragma GCC unroll 8
+            for ( j = 0; j < w; j++ )
+            {
+                s[j] = _mm_aesenc_si128 ( s[j], k[r] );
+            }
+        }
+
+#pragma GCC unroll 8
+        for ( j = 0; j < w; j++ )
+        {
+            s[j] = _mm_aesenclast_si128 ( s[j], k[AESNI_ROUNDS] );
+            _mm_storeu_si128 ( ( __m128i * ) ( dst[j] + off ), s[j] );
+        }
+    }
+
+    for ( j = 0; j < w; j++ )
+    {
+        x[j] = s[j];
+        src[j] += blocks * AESNI_BLOCKLEN;
+        dst[j] += blocks * AESNI_BLOCKLEN;
+    }
+}
+
+/**
+ * Encrypt independent CBC chains with AES-256, rounds of all chains interleaved
+ */
+static AESNI_TARGET void aesni_cbc_encrypt_lanes_base ( const struct aesni_key_t *key,
+    struct aesni_lane_t *lanes, int n )
+{
+    int i;
+    int j;
+    int r;
+    int active = 0;
+    size_t step;
+    size_t left[AESNI_LANES];
+    int map[AESNI_LANES];
+    const uint8_t *src[AESNI_LANES];
+    uint8_t *dst[AESNI_LANES];
+    __m128i k[AESNI_ROUNDS + 1];
+    __m128i x[AESNI_LANES];
+
+    for ( r = 0; r <= AESNI_ROUNDS; r++ )
+    {
+        k[r] = _mm_loadu_si128 ( ( const __m128i * ) key->rk + r );
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( lanes[i].len >= AESNI_BLOCKLEN )
+        {
+            map[active] = i;
+            left[active] = lanes[i].len / AESNI_BLOCKLEN;
+            src[active] = lanes[i].src;
+            dst[active] = lanes[i].dst;
+            x[active] = _mm_loadu_si128 ( ( const __m128i * ) lanes[i].iv );
+            active++;
+        }
+    }
+
+    while ( active > 1 )
+    {
+        /* Run all chains for as long as the shortest one lasts */
+        step = left[0];
+
+        for ( j = 1; j < active; j++ )
+        {
+            step = left[j] < step ? left[j] : step;
+        }
+
+        /* Width is a constant in each branch, so the state fits registers */
+        switch ( active )
+        {
+        case 2:
+            aesni_cbc_encrypt_group ( k, x, src, dst, step, 2 );
+            break;
+        case 3:
+            aesni_cbc_encrypt_group ( k, x, src, dst, step, 3 );
+            break;
+        case 4:
+            aesni_cbc_encrypt_group ( k, x, src, dst, step, 4 );
+            break;
+        case 5:
+            aesni_cbc_encrypt_group ( k, x, src, dst, step, 5 );
+            break;
+        case 6:
+            aesni_cbc_encrypt_group ( k, x, src, dst, step, 6 );
+            break;
+        case 7:
+            aesni_cbc_encrypt_group ( k, x, src, dst, step, 7 );
+            break;
+        default:
+            aesni_cbc_encrypt_group ( k, x, src, dst, step, 8 );
+            break;
+        }
+
+        /* Retire finished chains */
+        for ( i = 0, j = 0; j < active; j++ )
+        {
+            if ( ( left[j] -= step ) )
+            {
+                map[i] = map[j];
+                left[i] = left[j];
+                src[i] = src[j];
+                dst[i] = dst[j];
+                x[i] = x[j];
+                i++;
+
+            } else
+            {
+                _mm_storeu_si128 ( ( __m128i * ) lanes[map[j]].iv, x[j] );
+            }
+        }
+
+        active = i;
+    }
+
+    /* Longest chain finishes alone */
+    if ( active )
+    {
+        _mm_storeu_si128 ( ( __m128i * ) lanes[map[0]].iv, x[0] );
+        aesni_cbc_encrypt_base ( key, left[0] * AESNI_BLOCKLEN, lanes[map[0]].iv, src[0],
+            dst[0] );
+    }
+}
+
+/**
+ * Decrypt blocks with AES-256 in CBC mode, eight blocks interleaved
+ */
+static AESNI_TARGET void aesni_cbc_decrypt_base ( const struct aesni_key_t *key, size_t len,
+    uint8_t * iv, const uint8_t * src, uint8_t * dst )
+{
+    int i;
+    int r;
+    __m128i k[AESNI_ROUNDS + 1];
+    __m128i c[8];
+    __m128i x[8];
+    __m128i prev;
+
+    for ( r = 0; r <= AESNI_ROUNDS; r++ )
+    {
+        k[r] = _mm_loadu_si128 ( ( const __m128i * ) key->rk + r );
+    }
+
+    prev = _mm_loadu_si128 ( ( const __m128i * ) iv );
+
+    for ( ; len >= 8 * AESNI_BLOCKLEN; len -= 8 * AESNI_BLOCKLEN )
+    {
+        for ( i = 0; i < 8; i++ )
+        {
+            c[i] = _mm_loadu_si128 ( ( const __m128i * ) src + i );
+            x[i] = _mm_xor_si128 ( c[i], k[0] );
+        }
+
+        for ( r = 1; r < AESNI_ROUNDS; r++ )
+        {
+            for ( i = 0; i < 8; i++ )
+            {
+                x[i] = _mm_aesdec_si128 ( x[i], k[r] );
+            }
+        }
+
+        x[0] = _mm_xor_si128 ( _mm_aesdeclast_si128 ( x[0], k[AESNI_ROUNDS] ), prev );
+
+        for ( i = 1; i < 8; i++ )
+        {
+            x[i] = _mm_xor_si128 ( _mm_aesdeclast_si128 ( x[i], k[AESNI_ROUNDS] ), c[i - 1] );
+        }
+
+        for ( i = 0; i < 8; i++ )
+        {
+            _mm_storeu_si128 ( ( __m128i * ) dst + i, x[i] );
+        }
+
+        prev = c[7];
+        src += 8 * AESNI_BLOCKLEN;
+        dst += 8 * AESNI_BLOCKLEN;
+    }
+
+    for ( ; len >= AESNI_BLOCKLEN; len -= AESNI_BLOCKLEN )
+    {
+        c[0] = _mm_loadu_si128 ( ( const __m128i * ) src );
+        x[0] = _mm_xor_si128 ( c[0], k[0] );
+
+        for ( r = 1; r < AESNI_ROUNDS; r++ )
+        {
+            x[0] = _mm_aesdec_si128 ( x[0], k[r] );
+        }
+
+        x[0] = _mm_xor_si128 ( _mm_aesdeclast_si128 ( x[0], k[AESNI_ROUNDS] ), prev );
+        _mm_storeu_si128 ( ( __m128i * ) dst, x[0] );
+
+        prev = c[0];
+        src += AESNI_BLOCKLEN;
+        dst += AESNI_BLOCKLEN;
+    }
+
+    _mm_storeu_si128 ( ( __m128i * ) iv, prev );
+}
+
+/**
+ * Decrypt blocks with AES-256 in CBC mode, four 256-bit lanes interleaved
+ */
+static VAES256_TARGET size_t aesni_cbc_decrypt_vaes256 ( const struct aesni_key_t *key,
+    size_t len, uint8_t * iv, const uint8_t * src, uint8_t * dst )
+{
+    int i;
+    int r;
+    size_t done = 0;
+    __m256i k[AESNI_ROUNDS + 1];
+    __m256i c[4];
+    __m256i x[4];
+    __m256i prev;
+
+    for ( r = 0; r <= AESNI_ROUNDS; r++ )
+    {
+        k[r] = _mm256_broadcastsi128_si256 ( _mm_loadu_si128 ( ( const __m128i * ) key->rk + r ) );
+    }
+
+    /* Only the upper lane of the previous vector is ever used */
+    prev = _mm256_broadcastsi128_si256 ( _mm_loadu_si128 ( ( const __m128i * ) iv ) );
+
+    for ( ; len - done >= 8 * AESNI_BLOCKLEN; done += 8 * AESNI_BLOCKLEN )
+    {
+        for ( i = 0; i < 4; i++ )
+        {
+            c[i] = _mm256_loadu_si256 ( ( const __m256i * ) ( src + done ) + i );
+            x[i] = _mm256_xor_si256 ( c[i], k[0] );
+        }
+
+        for ( r = 1; r < AESNI_ROUNDS; r++ )
+        {
+            for ( i = 0; i < 4; i++ )
+            {
+                x[i] = _mm256_aesdec_epi128 ( x[i], k[r] );
+            }
+        }
+
+        x[0] = _mm256_xor_si256 ( _mm256_aesdeclast_epi128 ( x[0], k[AESNI_ROUNDS] ),
+            _mm256_permute2x128_si256 ( prev, c[0], 0x21 ) );
+
+        for ( i = 1; i < 4; i++ )
+        {
+            x[i] = _mm256_xor_si256 ( _mm256_aesdeclast_epi128 ( x[i], k[AESNI_ROUNDS] ),
+                _mm256_permute2x128_si256 ( c[i - 1], c[i], 0x21 ) );
+        }
+
+        for ( i = 0; i < 4; i++ )
+        {
+            _mm256_storeu_si256 ( ( __m256i * ) ( dst + done ) + i, x[i] );
+        }
+
+        prev = c[3];
+    }
+
+    _mm_storeu_si128 ( ( __m128i * ) iv, _mm256_extracti128_si256 ( prev, 1 ) );
+
+    return done;
+}
+
+/**
+ * Decrypt blocks with AES-256 in CBC mode, four 512-bit lanes interleaved
+ */
+static VAES512_TARGET size_t aesni_cbc_decrypt_vaes512 ( const struct aesni_key_t *key,
+    size_t len, uint8_t * iv, const uint8_t * src, uint8_t * dst )
+{
+    int i;
+    int r;
+    size_t done = 0;
+    __m512i k[AESNI_ROUNDS + 1];
+    __m512i c[4];
+    __m512i x[4];
+    __m512i prev;
+
+    for ( r = 0; r <= AESNI_ROUNDS; r++ )
+    {
+        k[r] = _mm512_broadcast_i32x4 ( _mm_loadu_si128 ( ( const __m128i * ) key->rk + r ) );
+    }
+
+    /* Only the top lane of the previous vector is ever used */
+    prev = _mm512_broadcast_i32x4 ( _mm_loadu_si128 ( ( const __m128i * ) iv ) );
+
+    for ( ; len - done >= 16 * AESNI_BLOCKLEN; done += 16 * AESNI_BLOCKLEN )
+    {
+        for ( i = 0; i < 4; i++ )
+        {
+            c[i] = _mm512_loadu_si512 ( ( const __m512i * ) ( src + done ) + i );
+            x[i] = _mm512_xor_si512 ( c[i], k[0] );
+        }
+
+        for ( r = 1; r < AESNI_ROUNDS; r++ )
+        {
+            for ( i = 0; i < 4; i++ )
+            {
+                x[i] = _mm512_aesdec_epi128 ( x[i], k[r] );
+            }
+        }
+
+        x[0] = _mm512_xor_si512 ( _mm512_aesdeclast_epi128 ( x[0], k[AESNI_ROUNDS] ),
+            _mm512_alignr_epi32 ( c[0], prev, 12 ) );
+
+        for ( i = 1; i < 4; i++ )
+        {
+            x[i] = _mm512_xor_si512 ( _mm512_aesdeclast_epi128 ( x[i], k[AESNI_ROUNDS] ),
+                _mm512_alignr_epi32 ( c[i], c[i - 1], 12 ) );
+        }
+
+        for ( i = 0; i < 4; i++ )
+        {
+            _mm512_storeu_si512 ( ( __m512i * ) ( dst + done ) + i, x[i] );
+        }
+
+        prev = c[3];
+    }
+
+    _mm_storeu_si128 ( ( __m128i * ) iv, _mm512_extracti32x4_epi32 ( prev, 3 ) );
+
+    return done;
+}
+
+/**
+ * Encrypt blocks with AES-256 in CBC mode
+ */
+void aesni_cbc_encrypt ( const struct aesni_key_t *key, size_t len, uint8_t * iv,
+    const uint8_t * src, uint8_t * dst )
+{
+    /* Chained encryption is serial, wide lanes cannot help here */
+    aesni_cbc_encrypt_base ( key, len, iv, src, dst );
+}
+
+/**
+ * Encrypt up to AESNI_LANES independent CBC chains at once
+ */
+void aesni_cbc_encrypt_lanes ( const struct aesni_key_t *key, struct aesni_lane_t *lanes, int n )
+{
+    /* Chains of other streams fill the pipeline a single chain leaves idle */
+    aesni_cbc_encrypt_lanes_base ( key, lanes, n );
+}
+
+/**
+ * Decrypt blocks with AES-256 in CBC mode
+ */
+void aesni_cbc_decrypt ( const struct aesni_key_t *key, size_t len, uint8_t * iv,
+    const uint8_t * src, uint8_t * dst )
+{
+    size_t done = 0;
+
+    switch ( key->level )
+    {
+    case AESNI_VAES512:
+        done = aesni_cbc_decrypt_vaes512 ( key, len, iv, src, dst );
+        break;
+    case AESNI_VAES256:
+        done = aesni_cbc_decrypt_vaes256 ( key, len, iv, src, dst );
+        break;
+    }
+
+    aesni_cbc_decrypt_base ( key, len - done, iv, src + done, dst + done );
+}
+
+#else
+
+/**
+ * Detect best AES instruction set supported
+ */
+int aesni_detect ( void )
+{
+    return AESNI_NONE;
+}
+
+/**
+ * Get AES instruction set name
+ */
+const char *aesni_level_name ( int level )
+{
+    UNUSED ( level );
+    return "none";
+}
+
+/**
+ * Expand AES-256 encryption key
+ */
+int aesni_setkey_enc ( struct aesni_key_t *key, const uint8_t * rawkey, int level )
+{
+    UNUSED ( key );
+    UNUSED ( rawkey );
+    UNUSED ( level );
+    return -1;
+}
+
+/**
+ * Expand AES-256 decryption key
+ */
+int aesni_setkey_dec ( struct aesni_key_t *key, const uint8_t * rawkey, int level )
+{
+    UNUSED ( key );
+    UNUSED ( rawkey );
+    UNUSED ( level );
+    return -1;
+}
+
+/**
+ * Encrypt blocks with AES-256 in CBC mode
+ */
+void aesni_cbc_encrypt ( const struct aesni_key_t *key, size_t len, uint8_t * iv,
+    const uint8_t * src, uint8_t * dst )
+{
+    UNUSED ( key );
+    UNUSED ( len );
+    UNUSED ( iv );
+    UNUSED ( src );
+    UNUSED ( dst );
+}
+
+/**
+ * Encrypt up to AESNI_LANES independent CBC chains at once
+ */
+void aesni_cbc_encrypt_lanes ( const struct aesni_key_t *key, struct aesni_lane_t *lanes, int n )
+{
+    UNUSED ( key );
+    UNUSED ( lanes );
+    UNUSED ( n );
+}
+
+/**
+ * Decrypt blocks with AES-256 in CBC mode
+ */
+void aesni_cbc_decrypt ( const struct aesni_key_t *key, size_t len, uint8_t * iv,
+    const uint8_t * src, uint8_t * dst )
+{
+    UNUSED ( key );
+    UNUSED ( len );
+    UNUSED ( iv );
+    UNUSED ( src );
+    UNUSED ( dst );
+}
+
+#endif
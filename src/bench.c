@@ -0,0 +1,227 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Frame Encryption Benchmark
+ * ------------------------------------------------------------------ */
+
+#include "sockscrypt.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define bench_cycles() __rdtsc()
+#else
+#define bench_cycles() 0
+#endif
+
+#define BENCH_CHUNKS 8192
+
+/**
+ * Print the rate of a finished run, return cycles per byte
+ */
+static double bench_report ( const char *name, int chunk_len, int chunks, uint64_t usec,
+    uint64_t cycles )
+{
+    double bytes = ( double ) chunk_len * chunks;
+
+    if ( !usec )
+    {
+        usec = 1;
+    }
+
+    printf ( "%-10s %6d B chunks %8lu MB/s %6.2f cycles/B\n", name, chunk_len,
+        ( unsigned long ) ( bytes / usec * 1000000 / 1048576 ), cycles / bytes );
+
+    return cycles / bytes;
+}
+
+/**
+ * Encrypt chunks block by block the way frames were built before whole-frame CBC
+ */
+static int bench_reference ( struct sc_context_t *context, int chunk_len, int chunks,
+    double *cpb )
+{
+    int i;
+    int vlen;
+    int ipos;
+    int opos;
+    uint8_t *src;
+    uint8_t *dst;
+    uint64_t usec;
+    uint64_t cycles;
+    uint8_t iv[AES256_BLOCKLEN];
+    uint8_t workbuf[AES256_BLOCKLEN];
+
+    /* Old frames carried a 16-bit length */
+    if ( chunk_len >= 65536 )
+    {
+        return -1;
+    }
+
+    if ( !( src = malloc ( 2 * chunk_len + 2 * AES256_BLOCKLEN ) ) )
+    {
+        return -1;
+    }
+
+    dst = src + chunk_len;
+    memset ( src, 0x3c, chunk_len );
+    memset ( iv, '\0', sizeof ( iv ) );
+
+    usec = sc_clock_usec (  );
+    cycles = bench_cycles (  );
+
+    for ( i = 0; i < chunks; i++ )
+    {
+        ipos = 0;
+        opos = 0;
+
+        /* Length header shares the first block with the data */
+        workbuf[0] = ( chunk_len & 0xff00 ) >> 8;
+        workbuf[1] = chunk_len & 0xff;
+
+        vlen = chunk_len > AES256_BLOCKLEN - 2 ? AES256_BLOCKLEN - 2 : chunk_len;
+        memset ( workbuf + 2, '\0', AES256_BLOCKLEN - 2 );
+        memcpy ( workbuf + 2, src, vlen );
+        ipos += vlen;
+
+        mbedtls_aes_crypt_cbc ( &context->aes_enc, MBEDTLS_AES_ENCRYPT, AES256_BLOCKLEN, iv,
+            workbuf, dst + opos );
+        opos += AES256_BLOCKLEN;
+
+        while ( ipos < chunk_len )
+        {
+            if ( ( vlen = chunk_len - ipos ) > AES256_BLOCKLEN )
+            {
+                vlen = AES256_BLOCKLEN;
+            }
+
+            memset ( workbuf, '\0', AES256_BLOCKLEN );
+            memcpy ( workbuf, src + ipos, vlen );
+            ipos += vlen;
+
+            mbedtls_aes_crypt_cbc ( &context->aes_enc, MBEDTLS_AES_ENCRYPT, AES256_BLOCKLEN, iv,
+                workbuf, dst + opos );
+            opos += AES256_BLOCKLEN;
+        }
+    }
+
+    cycles = bench_cycles (  ) - cycles;
+    usec = sc_clock_usec (  ) - usec;
+    free ( src );
+
+    *cpb = bench_report ( "per-block", chunk_len, chunks, usec, cycles );
+
+    return 0;
+}
+
+/**
+ * Encrypt chunks the way the forwarding path does and report the rate
+ */
+static int bench_engine ( struct sc_context_t *context, const struct sc_engine_t *engine,
+    int chunk_len, int chunks, double *cpb )
+{
+    int i;
+    int len;
+    uint8_t *buffer;
+    uint64_t usec;
+    uint64_t cycles;
+    struct sc_stream_t stream;
+
+    if ( sc_engine_select ( context, engine ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( sc_new_stream ( &stream, context, TRUE ) < 0 )
+    {
+        return -1;
+    }
+
+    usec = sc_clock_usec (  );
+    cycles = bench_cycles (  );
+
+    for ( i = 0; i < chunks; i++ )
+    {
+        /* Payload content does not matter, recv would fill it in place */
+        if ( !( buffer = sc_input_buffer ( &stream, &len ) ) || len < chunk_len
+            || sc_process_data ( &stream, chunk_len ) < 0 )
+        {
+            sc_free_stream ( &stream );
+            return -1;
+        }
+
+        while ( sc_output_data ( &stream, &len ) )
+        {
+            sc_consume_data ( &stream, len );
+        }
+    }
+
+    cycles = bench_cycles (  ) - cycles;
+    usec = sc_clock_usec (  ) - usec;
+    sc_free_stream ( &stream );
+
+    *cpb = bench_report ( engine->name, chunk_len, chunks, usec, cycles );
+
+    return 0;
+}
+
+/**
+ * Program entry point
+ */
+int main ( int argc, char *argv[] )
+{
+    int i;
+    int chunk_len = FORWARD_CHUNK_LEN;
+    int chunks = BENCH_CHUNKS;
+    double cpb;
+    double reference = 0;
+    uint8_t key[AES256_KEYLEN];
+    const struct sc_engine_t *engine;
+    struct sc_context_t context;
+
+    if ( argc > 1 )
+    {
+        chunk_len = atoi ( argv[1] );
+    }
+
+    if ( argc > 2 )
+    {
+        chunks = atoi ( argv[2] );
+    }
+
+    if ( chunk_len <= 0 || chunk_len > RING_BUFFER_SIZE / 4 || chunks <= 0 )
+    {
+        fprintf ( stderr, "usage: %s [chunk-len] [chunks]\n", argv[0] );
+        return 1;
+    }
+
+    /* Key content does not affect the rate */
+    memset ( key, 0x5a, sizeof ( key ) );
+
+    if ( sc_init ( &context, key, sizeof ( key ) ) < 0 )
+    {
+        fprintf ( stderr, "cannot initialize crypto context\n" );
+        return 1;
+    }
+
+    /* Old per-block loop first, the mbedtls row below compares against it */
+    if ( bench_reference ( &context, chunk_len, chunks, &reference ) < 0 )
+    {
+        printf ( "%-10s needs chunks below 64 KB\n", "per-block" );
+    }
+
+    for ( i = 0; ( engine = sc_engine_at ( i ) ); i++ )
+    {
+        if ( bench_engine ( &context, engine, chunk_len, chunks, &cpb ) < 0 )
+        {
+            printf ( "%-10s unavailable\n", engine->name );
+            continue;
+        }
+
+        if ( reference > 0 && !strcmp ( engine->name, "mbedtls" ) )
+        {
+            printf ( "mbedtls whole frame vs per block: %.2f -> %.2f cycles/B\n", reference,
+                cpb );
+        }
+    }
+
+    sc_free ( &context );
+    return 0;
+}
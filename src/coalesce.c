@@ -0,0 +1,223 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Small Read Coalescing Source Code
+ * ------------------------------------------------------------------ */
+
+#include <sys/timerfd.h>
+
+#include "coalesce.h"
+
+/**
+ * Register coalescing timer with the proxy
+ */
+int coalesce_attach ( struct proxy_t *proxy )
+{
+    int fd;
+    struct stream_t *stream;
+
+    if ( ( fd = timerfd_create ( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC ) ) < 0 )
+    {
+        failure ( "cannot create coalescing timer (%i)\n", errno );
+        return -1;
+    }
+
+    if ( !( stream = insert_stream ( proxy, fd ) ) )
+    {
+        close ( fd );
+        return -1;
+    }
+
+    stream->role = L_COALESCE;
+    stream->events = POLLIN;
+    proxy->coalesce_timer = stream;
+
+    return 0;
+}
+
+/**
+ * Arm timer for the earliest deadline
+ */
+static void coalesce_arm ( struct proxy_t *proxy )
+{
+    uint64_t deadline;
+    struct itimerspec spec = { 0 };
+
+    if ( !proxy->coalesce_head )
+    {
+        return;
+    }
+
+    deadline = proxy->coalesce_head->coalesce_deadline;
+
+    /* Timer already fires early enough */
+    if ( proxy->coalesce_armed && proxy->coalesce_armed <= deadline )
+    {
+        return;
+    }
+
+    spec.it_value.tv_sec = deadline / 1000000;
+    spec.it_value.tv_nsec = ( deadline % 1000000 ) * 1000;
+
+    if ( timerfd_settime ( proxy->coalesce_timer->fd, TFD_TIMER_ABSTIME, &spec, NULL ) < 0 )
+    {
+        failure ( "cannot arm coalescing timer (%i)\n", errno );
+        return;
+    }
+
+    proxy->coalesce_armed = deadline;
+}
+
+/**
+ * Append stream to the deadline queue
+ */
+static void coalesce_link ( struct proxy_t *proxy, struct stream_t *stream, uint64_t deadline )
+{
+    /* Window is the same for all streams, so the queue stays sorted */
+    stream->coalescing = 1;
+    stream->coalesce_deadline = deadline;
+    stream->coalesce_next = NULL;
+    stream->coalesce_prev = proxy->coalesce_tail;
+
+    if ( proxy->coalesce_tail )
+    {
+        proxy->coalesce_tail->coalesce_next = stream;
+
+    } else
+    {
+        proxy->coalesce_head = stream;
+    }
+
+    proxy->coalesce_tail = stream;
+}
+
+/**
+ * Stop watching the stream
+ */
+void coalesce_release ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( !stream->coalescing )
+    {
+        return;
+    }
+
+    if ( stream->coalesce_prev )
+    {
+        stream->coalesce_prev->coalesce_next = stream->coalesce_next;
+
+    } else
+    {
+        proxy->coalesce_head = stream->coalesce_next;
+    }
+
+    if ( stream->coalesce_next )
+    {
+        stream->coalesce_next->coalesce_prev = stream->coalesce_prev;
+
+    } else
+    {
+        proxy->coalesce_tail = stream->coalesce_prev;
+    }
+
+    stream->coalescing = 0;
+    stream->coalesce_prev = NULL;
+    stream->coalesce_next = NULL;
+}
+
+/**
+ * Watch stream for small reads held back
+ */
+void coalesce_track ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    uint64_t deadline;
+
+    if ( !proxy->coalesce_timer )
+    {
+        return;
+    }
+
+    if ( !stream->sc.pending_len )
+    {
+        coalesce_release ( proxy, stream );
+        return;
+    }
+
+    deadline = stream->sc.pending_usec + proxy->sc_context.coalesce_usec;
+
+    /* Still waiting on the same held reads */
+    if ( stream->coalescing && stream->coalesce_deadline == deadline )
+    {
+        return;
+    }
+
+    coalesce_release ( proxy, stream );
+    coalesce_link ( proxy, stream, deadline );
+    coalesce_arm ( proxy );
+}
+
+/**
+ * Frame small reads whose window has expired
+ */
+int coalesce_events ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int status;
+    uint64_t now;
+    uint64_t count;
+    struct stream_t *iter;
+    struct stream_t *neighbour;
+
+    if ( ~stream->revents & POLLIN )
+    {
+        return -1;
+    }
+
+    if ( read ( stream->fd, &count, sizeof ( count ) ) < 0 && errno != EAGAIN )
+    {
+        failure ( "cannot read coalescing timer (%i)\n", errno );
+        return -1;
+    }
+
+    stream_would_block ( stream, POLLIN );
+
+    proxy->coalesce_armed = 0;
+    now = sc_clock_usec (  );
+
+    while ( ( iter = proxy->coalesce_head ) && iter->coalesce_deadline <= now )
+    {
+        coalesce_release ( proxy, iter );
+        neighbour = iter->neighbour;
+
+        if ( iter->abandoned || iter->pipe || !neighbour )
+        {
+            continue;
+        }
+
+        if ( ( status = sc_flush_pending ( &iter->sc ) ) < 0 )
+        {
+            failure ( "crypto data processing failed on socket:%i\n", iter->fd );
+            remove_relation ( iter );
+            schedule_stream ( proxy, iter );
+            schedule_stream ( proxy, neighbour );
+            continue;
+        }
+
+        /* Ring is full, try again once more data is sent */
+        if ( status > 0 )
+        {
+            coalesce_link ( proxy, iter, now + proxy->sc_context.coalesce_usec );
+            continue;
+        }
+
+        if ( sc_has_output ( &iter->sc ) )
+        {
+            neighbour->events |= POLLOUT;
+
+            if ( neighbour->lrevents & POLLOUT )
+            {
+                schedule_stream ( proxy, neighbour );
+            }
+        }
+    }
+
+    coalesce_arm ( proxy );
+
+    return 0;
+}
@@ -4,6 +4,10 @@
 
 #include "sockscrypt.h"
 
+#ifdef SOCKSCRYPT_OPENSSL
+#include <openssl/evp.h>
+#endif
+
 /**
  * Initialize random generator wrapper
  */
@@ -57,294 +61,1604 @@ static void sc_random_free ( struct sc_random_t *random )
 }
 
 /**
- * Initialize SC context
+ * Refill nonce pool if running low
  */
-int sc_init ( struct sc_context_t *context, const uint8_t * key, size_t keylen )
+int sc_refill_nonces ( struct sc_context_t *context )
 {
-    memset ( context, '\0', sizeof ( struct sc_context_t ) );
+    size_t len;
+    struct sc_nonce_pool_t *pool = &context->nonce_pool;
 
-    context->initialized = FALSE;
-
-    if ( keylen != sizeof ( context->aeskey ) )
+    if ( pool->avail > SC_NONCE_POOL_SIZE / 2 )
     {
-        return -1;
+        return 0;
     }
 
-    memcpy ( context->aeskey, key, keylen );
-
-    if ( sc_random_init ( &context->random ) < 0 )
+    /* Generate nonces with as few DRBG requests as possible */
+    while ( pool->avail < SC_NONCE_POOL_SIZE )
     {
-        return -1;
+        len = ( SC_NONCE_POOL_SIZE - pool->avail ) * AES256_BLOCKLEN;
+
+        if ( len > MBEDTLS_CTR_DRBG_MAX_REQUEST )
+        {
+            len = MBEDTLS_CTR_DRBG_MAX_REQUEST - MBEDTLS_CTR_DRBG_MAX_REQUEST % AES256_BLOCKLEN;
+        }
+
+        if ( sc_random_bytes ( &context->random, pool->nonces[pool->avail], len ) < 0 )
+        {
+            return -1;
+        }
+
+        pool->avail += len / AES256_BLOCKLEN;
     }
 
-    context->initialized = TRUE;
-    return 0;
+    pool->refills++;
+
+    return 1;
 }
 
 /**
- * Uninitialize SC context
+ * Take nonce from the pool
  */
-void sc_free ( struct sc_context_t *context )
+static int sc_take_nonce ( struct sc_context_t *context, uint8_t * nonce )
 {
-    if ( context->initialized )
+    struct sc_nonce_pool_t *pool = &context->nonce_pool;
+
+    if ( !pool->avail )
     {
-        sc_random_free ( &context->random );
-        memset ( context, '\0', sizeof ( struct sc_context_t ) );
+        pool->misses++;
+        return sc_random_bytes ( &context->random, nonce, AES256_BLOCKLEN );
     }
+
+    pool->avail--;
+    memcpy ( nonce, pool->nonces[pool->avail], AES256_BLOCKLEN );
+    memset ( pool->nonces[pool->avail], '\0', AES256_BLOCKLEN );
+    pool->hits++;
+
+    return 0;
 }
 
 /**
- * Create new SC stream
+ * Derive wire v2 markers and subkeys from the AES key
  */
-int sc_new_stream ( struct sc_stream_t *stream, struct sc_context_t *context, int encrypt )
+static int sc_aead_derive ( struct sc_context_t *context )
 {
-    uint8_t rawkey[AES256_KEYLEN];
-
-    memset ( stream, '\0', sizeof ( struct sc_stream_t ) );
-
-    mbedtls_aes_init ( &stream->aes );
+    int i;
+    int aead;
+    uint8_t label[AES256_BLOCKLEN];
 
-    if ( encrypt )
+    for ( aead = SC_AEAD_GCM; aead < SC_AEAD_COUNT; aead++ )
     {
-        if ( sc_random_bytes ( &context->random, stream->iv, sizeof ( stream->iv ) ) < 0 )
+        /* Label is version, cipher, purpose and block index */
+        memset ( label, '\0', sizeof ( label ) );
+        label[0] = SC_WIRE_V2;
+        label[1] = aead;
+
+        if ( mbedtls_aes_crypt_ecb ( &context->aes_enc, MBEDTLS_AES_ENCRYPT, label,
+                context->aead_marker[aead] ) != 0 )
         {
             return -1;
         }
-    }
 
-    memcpy ( rawkey, context->aeskey, AES256_KEYLEN );
+        label[2] = 1;
 
-    if ( encrypt )
-    {
-        if ( mbedtls_aes_setkey_enc ( &stream->aes, context->aeskey, AES256_KEYLEN_BITS ) != 0 )
+        for ( i = 0; i < AES256_KEYLEN / AES256_BLOCKLEN; i++ )
         {
-            mbedtls_aes_free ( &stream->aes );
-            memset ( rawkey, '\0', sizeof ( rawkey ) );
-            return -1;
+            label[3] = i;
+
+            if ( mbedtls_aes_crypt_ecb ( &context->aes_enc, MBEDTLS_AES_ENCRYPT, label,
+                    context->aead_key[aead] + i * AES256_BLOCKLEN ) != 0 )
+            {
+                return -1;
+            }
         }
+    }
 
-    } else
+    /* Kernel TLS hello marker */
+    memset ( label, '\0', sizeof ( label ) );
+    label[0] = SC_WIRE_KTLS;
+
+    if ( mbedtls_aes_crypt_ecb ( &context->aes_enc, MBEDTLS_AES_ENCRYPT, label,
+            context->ktls_marker ) != 0 )
     {
-        if ( mbedtls_aes_setkey_dec ( &stream->aes, context->aeskey, AES256_KEYLEN_BITS ) != 0 )
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Derive kernel TLS key and iv from the hello nonce
+ */
+static int sc_ktls_derive ( const struct sc_context_t *context, const uint8_t * nonce,
+    uint8_t * key, uint8_t * iv )
+{
+    int i;
+    uint8_t label[AES256_BLOCKLEN];
+    uint8_t block[AES256_BLOCKLEN];
+
+    for ( i = 0; i < 3; i++ )
+    {
+        memcpy ( label, nonce, AES256_BLOCKLEN );
+        label[0] ^= SC_WIRE_KTLS;
+        label[1] ^= 1 + i;
+
+        /* Context is only read, but mbedtls wants it mutable */
+        if ( mbedtls_aes_crypt_ecb ( ( mbedtls_aes_context * ) & context->aes_enc,
+                MBEDTLS_AES_ENCRYPT, label, i < 2 ? key + i * AES256_BLOCKLEN : block ) != 0 )
         {
-            mbedtls_aes_free ( &stream->aes );
-            memset ( rawkey, '\0', sizeof ( rawkey ) );
+            memset ( block, '\0', sizeof ( block ) );
             return -1;
         }
     }
 
-    memset ( rawkey, '\0', sizeof ( rawkey ) );
+    memcpy ( iv, block, SC_KTLS_SALTLEN + SC_KTLS_IVLEN );
+    memset ( block, '\0', sizeof ( block ) );
 
-    stream->processed_size = 2 * AES256_BLOCKLEN + FORWARD_CHUNK_LEN;   /* iv + len + data */
+    return 0;
+}
+
+/**
+ * Build kernel TLS hello and derive its sending key
+ */
+int sc_ktls_hello ( struct sc_context_t *context, uint8_t * hello, uint8_t * key, uint8_t * iv )
+{
+    memcpy ( hello, context->ktls_marker, AES256_BLOCKLEN );
 
-    if ( !( stream->processed = ( uint8_t * ) malloc ( stream->processed_size ) ) )
+    if ( sc_take_nonce ( context, hello + AES256_BLOCKLEN ) < 0 )
     {
-        mbedtls_aes_free ( &stream->aes );
         return -1;
     }
 
-    stream->flags = SC_STREAM_INITIALIZED;
+    return sc_ktls_derive ( context, hello + AES256_BLOCKLEN, key, iv );
+}
 
-    if ( encrypt )
+/**
+ * Check kernel TLS hello and derive its receiving key
+ */
+int sc_ktls_accept ( const struct sc_context_t *context, const uint8_t * hello, uint8_t * key,
+    uint8_t * iv )
+{
+    if ( memcmp ( hello, context->ktls_marker, AES256_BLOCKLEN ) )
     {
-        stream->flags |= SC_STREAM_ENCRYPT_MODE;
+        return -1;
     }
 
-    return 0;
+    return sc_ktls_derive ( context, hello + AES256_BLOCKLEN, key, iv );
 }
 
 /**
- * Encrypt traffic data
+ * Find wire cipher by name
  */
-static int sc_encrypt_data ( struct sc_stream_t *stream, const uint8_t * src, int len )
+int sc_aead_find ( const char *name )
 {
-    int vlen;
-    int ipos = 0;
-    int opos = 0;
-    uint8_t workbuf[AES256_BLOCKLEN];
+    if ( !strcmp ( name, "cbc" ) )
+    {
+        return SC_AEAD_NONE;
+    }
 
-    if ( len + 2 * AES256_BLOCKLEN > stream->processed_size
-        || len >= 65536 || stream->processed_len )
+    if ( !strcmp ( name, "gcm" ) )
     {
-        return -1;
+        return SC_AEAD_GCM;
     }
 
-    if ( ~stream->flags & SC_STREAM_SENT_TXNONCE )
+    if ( !strcmp ( name, "chacha20" ) )
     {
-        memcpy ( stream->processed, stream->iv, AES256_BLOCKLEN );
-        opos += AES256_BLOCKLEN;
-        stream->flags |= SC_STREAM_SENT_TXNONCE;
+        return SC_AEAD_CHACHA;
+    }
+
+    /* ChaCha20 outruns GCM without AES instructions */
+    if ( !strcmp ( name, "aead" ) )
+    {
+        return aesni_detect (  ) != AESNI_NONE ? SC_AEAD_GCM : SC_AEAD_CHACHA;
+    }
+
+    return -1;
+}
+
+/**
+ * Get wire cipher name
+ */
+const char *sc_aead_name ( int aead )
+{
+    switch ( aead )
+    {
+    case SC_AEAD_GCM:
+        return "aes-256-gcm";
+    case SC_AEAD_CHACHA:
+        return "chacha20-poly1305";
     }
 
-    workbuf[0] = ( len & 0xff00 ) >> 8;
-    workbuf[1] = len & 0xff;
+    return "aes-256-cbc";
+}
+
+/**
+ * Initialize SC context
+ */
+int sc_init ( struct sc_context_t *context, const uint8_t * key, size_t keylen )
+{
+    size_t i = 0;
+
+    memset ( context, '\0', sizeof ( struct sc_context_t ) );
 
-    vlen = len > AES256_BLOCKLEN - 2 ? AES256_BLOCKLEN - 2 : len;
-    memset ( workbuf + 2, '\0', AES256_BLOCKLEN - 2 );
-    memcpy ( workbuf + 2, src + ipos, vlen );
-    ipos += vlen;
+    context->initialized = FALSE;
 
-    if ( mbedtls_aes_crypt_cbc ( &stream->aes, MBEDTLS_AES_ENCRYPT, AES256_BLOCKLEN, stream->iv,
-            workbuf, stream->processed + opos ) != 0 )
+    if ( keylen != sizeof ( context->aeskey ) )
     {
         return -1;
     }
 
-    opos += AES256_BLOCKLEN;
+    memcpy ( context->aeskey, key, keylen );
 
-    while ( ipos < len )
+    if ( sc_random_init ( &context->random ) < 0 )
     {
-        if ( ( vlen = len - ipos ) > AES256_BLOCKLEN )
-        {
-            vlen = AES256_BLOCKLEN;
-        }
+        return -1;
+    }
 
-        memset ( workbuf, '\0', AES256_BLOCKLEN );
-        memcpy ( workbuf, src + ipos, vlen );
-        ipos += vlen;
+    /* Expand round keys once for all streams */
+    mbedtls_aes_init ( &context->aes_enc );
+    mbedtls_aes_init ( &context->aes_dec );
 
-        if ( mbedtls_aes_crypt_cbc ( &stream->aes, MBEDTLS_AES_ENCRYPT, AES256_BLOCKLEN, stream->iv,
-                workbuf, stream->processed + opos ) != 0 )
-        {
-            return -1;
-        }
+    if ( mbedtls_aes_setkey_enc ( &context->aes_enc, context->aeskey, AES256_KEYLEN_BITS ) != 0
+        || mbedtls_aes_setkey_dec ( &context->aes_dec, context->aeskey, AES256_KEYLEN_BITS ) != 0 )
+    {
+        mbedtls_aes_free ( &context->aes_enc );
+        mbedtls_aes_free ( &context->aes_dec );
+        sc_random_free ( &context->random );
+        return -1;
+    }
 
-        opos += AES256_BLOCKLEN;
+    if ( sc_aead_derive ( context ) < 0 || sc_refill_nonces ( context ) < 0 )
+    {
+        mbedtls_aes_free ( &context->aes_enc );
+        mbedtls_aes_free ( &context->aes_dec );
+        sc_random_free ( &context->random );
+        return -1;
     }
 
-    stream->processed_len = opos;
+    context->ring_size = RING_BUFFER_SIZE;
+    context->chunk_len = FORWARD_CHUNK_LEN;
+    context->coalesce_bytes = COALESCE_BYTES;
+
+    /* Engines are listed by preference, mbedtls always works */
+    while ( sc_engine_select ( context, sc_engine_at ( i++ ) ) < 0 )
+    {
+    }
 
+    context->initialized = TRUE;
     return 0;
 }
 
 /**
- * Decrypt traffic data
+ * Uninitialize SC context
  */
-static int sc_decrypt_data ( struct sc_stream_t *stream, const uint8_t * src, int len )
+void sc_free ( struct sc_context_t *context )
 {
-    int vlen;
-    int ipos = 0;
-    int opos = 0;
-    uint8_t workbuf[AES256_BLOCKLEN];
+    if ( context->initialized )
+    {
+        sc_random_free ( &context->random );
+        mbedtls_aes_free ( &context->aes_enc );
+        mbedtls_aes_free ( &context->aes_dec );
+        memset ( context, '\0', sizeof ( struct sc_context_t ) );
+    }
+}
+
+/**
+ * Get AES implementation name
+ */
+const char *sc_engine_name ( const struct sc_context_t *context )
+{
+    return context->engine->name;
+}
 
-    if ( len >= stream->processed_size || stream->processed_len )
+/**
+ * Encrypt or decrypt blocks with mbedtls
+ */
+static int sc_mbedtls_crypt ( struct sc_stream_t *stream, int len, const uint8_t * src,
+    uint8_t * dst )
+{
+    if ( stream->flags & SC_STREAM_ENCRYPT_MODE )
+    {
+        return mbedtls_aes_crypt_cbc ( &stream->context->aes_enc, MBEDTLS_AES_ENCRYPT, len,
+            stream->iv, src, dst ) != 0 ? -1 : 0;
+    }
+
+    return mbedtls_aes_crypt_cbc ( &stream->context->aes_dec, MBEDTLS_AES_DECRYPT, len,
+        stream->iv, src, dst ) != 0 ? -1 : 0;
+}
+
+/**
+ * Setup mbedtls engine, round keys are expanded by context init
+ */
+static int sc_mbedtls_setup ( struct sc_context_t *context, const struct sc_engine_t *engine )
+{
+    UNUSED ( context );
+    UNUSED ( engine );
+    return 0;
+}
+
+/**
+ * Expand round keys for AES instruction set
+ */
+static int sc_aesni_setup ( struct sc_context_t *context, const struct sc_engine_t *engine )
+{
+    if ( engine->level > aesni_detect (  ) )
     {
         return -1;
     }
 
-    if ( stream->unconsumed_len + len < AES256_BLOCKLEN )
+    if ( aesni_setkey_enc ( &context->aesni_enc, context->aeskey, engine->level ) < 0
+        || aesni_setkey_dec ( &context->aesni_dec, context->aeskey, engine->level ) < 0 )
     {
-        memcpy ( stream->unconsumed + stream->unconsumed_len, src, len );
-        stream->unconsumed_len += len;
-        return 0;
+        return -1;
     }
 
-    vlen = AES256_BLOCKLEN - stream->unconsumed_len;
-    memcpy ( stream->unconsumed + stream->unconsumed_len, src + ipos, vlen );
-    ipos += vlen;
-    stream->unconsumed_len = 0;
+    return 0;
+}
 
-    if ( ~stream->flags & SC_STREAM_RECV_RXNONCE )
+/**
+ * Encrypt or decrypt blocks with AES instruction set
+ */
+static int sc_aesni_crypt ( struct sc_stream_t *stream, int len, const uint8_t * src,
+    uint8_t * dst )
+{
+    if ( stream->flags & SC_STREAM_ENCRYPT_MODE )
     {
-        memcpy ( stream->iv, stream->unconsumed, AES256_BLOCKLEN );
-        stream->flags |= SC_STREAM_RECV_RXNONCE;
+        aesni_cbc_encrypt ( &stream->context->aesni_enc, len, stream->iv, src, dst );
 
     } else
     {
-        if ( mbedtls_aes_crypt_cbc ( &stream->aes, MBEDTLS_AES_DECRYPT, AES256_BLOCKLEN, stream->iv,
-                stream->unconsumed, workbuf ) != 0 )
+        aesni_cbc_decrypt ( &stream->context->aesni_dec, len, stream->iv, src, dst );
+    }
+
+    return 0;
+}
+
+/**
+ * Encrypt CBC chains of several streams with AES instruction set
+ */
+static void sc_aesni_encrypt_lanes ( const struct sc_context_t *context,
+    struct aesni_lane_t *lanes, int n )
+{
+    aesni_cbc_encrypt_lanes ( &context->aesni_enc, lanes, n );
+}
+
+#ifdef SOCKSCRYPT_OPENSSL
+
+/**
+ * Setup OpenSSL engine
+ */
+static int sc_openssl_setup ( struct sc_context_t *context, const struct sc_engine_t *engine )
+{
+    UNUSED ( context );
+    UNUSED ( engine );
+    return EVP_aes_256_cbc (  ) ? 0 : -1;
+}
+
+/**
+ * Encrypt or decrypt blocks with OpenSSL
+ */
+static int sc_openssl_crypt ( struct sc_stream_t *stream, int len, const uint8_t * src,
+    uint8_t * dst )
+{
+    int outlen;
+    EVP_CIPHER_CTX *ctx;
+
+    /* Cipher context keeps CBC chaining, so it is created on first use */
+    if ( !( ctx = stream->engine_ctx ) )
+    {
+        if ( !( ctx = EVP_CIPHER_CTX_new (  ) ) )
         {
             return -1;
         }
 
-        if ( stream->expected_len )
+        if ( EVP_CipherInit_ex ( ctx, EVP_aes_256_cbc (  ), NULL, stream->context->aeskey,
+                stream->iv, !!( stream->flags & SC_STREAM_ENCRYPT_MODE ) ) != 1
+            || EVP_CIPHER_CTX_set_padding ( ctx, 0 ) != 1 )
         {
-            vlen = stream->expected_len > AES256_BLOCKLEN ? AES256_BLOCKLEN : stream->expected_len;
-            memcpy ( stream->processed + opos, workbuf, vlen );
-            opos += vlen;
-            stream->expected_len -= vlen;
-
-        } else
-        {
-            stream->expected_len = ( workbuf[0] << 8 ) | workbuf[1];
-            vlen =
-                stream->expected_len >
-                AES256_BLOCKLEN - 2 ? AES256_BLOCKLEN - 2 : stream->expected_len;
-            memcpy ( stream->processed + opos, workbuf + 2, vlen );
-            opos += vlen;
-            stream->expected_len -= vlen;
+            EVP_CIPHER_CTX_free ( ctx );
+            return -1;
         }
+
+        stream->engine_ctx = ctx;
     }
 
-    while ( ipos + AES256_BLOCKLEN <= len )
+    if ( EVP_CipherUpdate ( ctx, dst, &outlen, src, len ) != 1 || outlen != len )
     {
-        if ( mbedtls_aes_crypt_cbc ( &stream->aes, MBEDTLS_AES_DECRYPT, AES256_BLOCKLEN, stream->iv,
-                src + ipos, workbuf ) != 0 )
-        {
-            return -1;
-        }
+        return -1;
+    }
 
-        ipos += AES256_BLOCKLEN;
+    return 0;
+}
 
-        if ( stream->expected_len )
-        {
-            vlen = stream->expected_len > AES256_BLOCKLEN ? AES256_BLOCKLEN : stream->expected_len;
-            memcpy ( stream->processed + opos, workbuf, vlen );
-            opos += vlen;
-            stream->expected_len -= vlen;
+/**
+ * Release OpenSSL stream state
+ */
+static void sc_openssl_release ( struct sc_stream_t *stream )
+{
+    EVP_CIPHER_CTX_free ( stream->engine_ctx );
+}
 
-        } else
-        {
-            stream->expected_len = ( workbuf[0] << 8 ) | workbuf[1];
-            vlen =
-                stream->expected_len >
-                AES256_BLOCKLEN - 2 ? AES256_BLOCKLEN - 2 : stream->expected_len;
-            memcpy ( stream->processed + opos, workbuf + 2, vlen );
-            opos += vlen;
-            stream->expected_len -= vlen;
-        }
-    }
+#endif
 
-    stream->processed_len = opos;
+/**
+ * Available engines, by preference
+ */
+static const struct sc_engine_t sc_engines[] = {
+    {"vaes-512", AESNI_VAES512, sc_aesni_setup, sc_aesni_crypt, NULL, sc_aesni_encrypt_lanes},
+    {"vaes-256", AESNI_VAES256, sc_aesni_setup, sc_aesni_crypt, NULL, sc_aesni_encrypt_lanes},
+    {"aes-ni", AESNI_BASE, sc_aesni_setup, sc_aesni_crypt, NULL, sc_aesni_encrypt_lanes},
+#ifdef SOCKSCRYPT_OPENSSL
+    {"openssl", 0, sc_openssl_setup, sc_openssl_crypt, sc_openssl_release, NULL},
+#endif
+    {"mbedtls", 0, sc_mbedtls_setup, sc_mbedtls_crypt, NULL, NULL}
+};
 
-    if ( ipos < len )
+/**
+ * Get AES implementation by index
+ */
+const struct sc_engine_t *sc_engine_at ( size_t index )
+{
+    if ( index >= sizeof ( sc_engines ) / sizeof ( sc_engines[0] ) )
     {
-        stream->unconsumed_len = len - ipos;
-        memcpy ( stream->unconsumed, src + ipos, stream->unconsumed_len );
+        return NULL;
     }
 
-    return 0;
+    return &sc_engines[index];
 }
 
 /**
- * Process traffic data
+ * Find AES implementation by name
  */
-int sc_process_data ( struct sc_stream_t *stream, const uint8_t * src, int len )
+const struct sc_engine_t *sc_engine_find ( const char *name )
 {
-    if ( ~stream->flags & SC_STREAM_INITIALIZED || stream->flags & SC_STREAM_ERROR_STATE )
+    size_t i;
+    const struct sc_engine_t *engine;
+
+    for ( i = 0; ( engine = sc_engine_at ( i ) ); i++ )
     {
-        return -1;
+        if ( !strcmp ( engine->name, name ) )
+        {
+            return engine;
+        }
     }
 
-    if ( stream->flags & SC_STREAM_ENCRYPT_MODE )
+    return NULL;
+}
+
+/**
+ * Switch context to AES implementation
+ */
+int sc_engine_select ( struct sc_context_t *context, const struct sc_engine_t *engine )
+{
+    if ( engine->setup ( context, engine ) < 0 )
     {
-        return sc_encrypt_data ( stream, src, len );
+        return -1;
     }
 
-    return sc_decrypt_data ( stream, src, len );
+    context->engine = engine;
+
+    return 0;
 }
 
 /**
- * Uninitialize SC stream
+ * Check engine output and time it on encryption and decryption
  */
-void sc_free_stream ( struct sc_stream_t *stream )
+static int sc_engine_measure ( const struct sc_engine_t *engine, struct sc_stream_t *enc,
+    struct sc_stream_t *dec, const uint8_t * plain, const uint8_t * reference, uint8_t * work,
+    unsigned long *rate )
 {
-    if ( stream->flags & SC_STREAM_INITIALIZED )
+    long msec;
+    unsigned long long nbytes = 0;
+    struct timespec start;
+    struct timespec now;
+
+    /* Engine must produce the very same wire bytes */
+    if ( engine->crypt ( enc, SC_BENCH_CHUNK, plain, work ) < 0
+        || memcmp ( work, reference, SC_BENCH_CHUNK )
+        || engine->crypt ( dec, SC_BENCH_CHUNK, work, work ) < 0
+        || memcmp ( work, plain, SC_BENCH_CHUNK ) )
     {
-        mbedtls_aes_free ( &stream->aes );
-        memset ( stream->unconsumed, '\0', sizeof ( stream->unconsumed ) );
-        memset ( stream->processed, '\0', stream->processed_size );
-        free ( stream->processed );
+        return -1;
+    }
+
+    clock_gettime ( CLOCK_MONOTONIC, &start );
+
+    do
+    {
+        if ( engine->crypt ( enc, SC_BENCH_CHUNK, plain, work ) < 0
+            || engine->crypt ( dec, SC_BENCH_CHUNK, work, work ) < 0 )
+        {
+            return -1;
+        }
+
+        nbytes += 2 * SC_BENCH_CHUNK;
+        clock_gettime ( CLOCK_MONOTONIC, &now );
+
+        msec = ( now.tv_sec - start.tv_sec ) * 1000 + ( now.tv_nsec - start.tv_nsec ) / 1000000;
+
+    } while ( msec < SC_BENCH_MSEC );
+
+    *rate = nbytes * 1000 / msec;
+
+    return 0;
+}
+
+/**
+ * Measure AES implementation throughput
+ */
+int sc_engine_benchmark ( struct sc_context_t *context, const struct sc_engine_t *engine,
+    unsigned long *rate )
+{
+    int i;
+    int status;
+    uint8_t *plain;
+    uint8_t *reference;
+    struct sc_stream_t enc;
+    struct sc_stream_t dec;
+    const struct sc_engine_t *saved = context->engine;
+
+    if ( !( plain = malloc ( 3 * SC_BENCH_CHUNK ) ) )
+    {
+        return -1;
+    }
+
+    reference = plain + SC_BENCH_CHUNK;
+
+    memset ( &enc, '\0', sizeof ( enc ) );
+    memset ( &dec, '\0', sizeof ( dec ) );
+    enc.context = context;
+    dec.context = context;
+    enc.engine = engine;
+    dec.engine = engine;
+    enc.flags = SC_STREAM_ENCRYPT_MODE;
+
+    /* Content does not matter, only the nonce is random */
+    for ( i = 0; i < SC_BENCH_CHUNK; i++ )
+    {
+        plain[i] = i * 131 + 7;
+    }
+
+    if ( sc_random_bytes ( &context->random, dec.iv, AES256_BLOCKLEN ) < 0 )
+    {
+        free ( plain );
+        return -1;
+    }
+
+    /* Reference ciphertext comes from mbedtls */
+    memcpy ( enc.iv, dec.iv, AES256_BLOCKLEN );
+
+    if ( sc_mbedtls_crypt ( &enc, SC_BENCH_CHUNK, plain, reference ) < 0 )
+    {
+        free ( plain );
+        return -1;
+    }
+
+    memcpy ( enc.iv, dec.iv, AES256_BLOCKLEN );
+
+    if ( sc_engine_select ( context, engine ) < 0 )
+    {
+        free ( plain );
+        return -1;
+    }
+
+    status =
+        sc_engine_measure ( engine, &enc, &dec, plain, reference, reference + SC_BENCH_CHUNK,
+        rate );
+
+    if ( engine->release )
+    {
+        engine->release ( &enc );
+        engine->release ( &dec );
+    }
+
+    memset ( plain, '\0', 3 * SC_BENCH_CHUNK );
+    free ( plain );
+
+    if ( saved )
+    {
+        sc_engine_select ( context, saved );
+    }
+
+    return status;
+}
+
+/**
+ * Setup AEAD cipher of the stream
+ */
+static int sc_aead_setup ( struct sc_stream_t *stream, int aead )
+{
+    mbedtls_gcm_context *gcm;
+    mbedtls_chachapoly_context *chachapoly;
+    const uint8_t *key = stream->context->aead_key[aead];
+
+    if ( aead == SC_AEAD_GCM )
+    {
+        if ( !( gcm = malloc ( sizeof ( mbedtls_gcm_context ) ) ) )
+        {
+            return -1;
+        }
+
+        mbedtls_gcm_init ( gcm );
+
+        if ( mbedtls_gcm_setkey ( gcm, MBEDTLS_CIPHER_ID_AES, key, AES256_KEYLEN_BITS ) != 0 )
+        {
+            mbedtls_gcm_free ( gcm );
+            free ( gcm );
+            return -1;
+        }
+
+        stream->aead_ctx = gcm;
+
+    } else
+    {
+        if ( !( chachapoly = malloc ( sizeof ( mbedtls_chachapoly_context ) ) ) )
+        {
+            return -1;
+        }
+
+        mbedtls_chachapoly_init ( chachapoly );
+
+        if ( mbedtls_chachapoly_setkey ( chachapoly, key ) != 0 )
+        {
+            mbedtls_chachapoly_free ( chachapoly );
+            free ( chachapoly );
+            return -1;
+        }
+
+        stream->aead_ctx = chachapoly;
+    }
+
+    stream->aead = aead;
+
+    return 0;
+}
+
+/**
+ * Release AEAD state of the stream
+ */
+static void sc_aead_release ( struct sc_stream_t *stream )
+{
+    if ( stream->aead == SC_AEAD_GCM )
+    {
+        mbedtls_gcm_free ( stream->aead_ctx );
+
+    } else if ( stream->aead == SC_AEAD_CHACHA )
+    {
+        mbedtls_chachapoly_free ( stream->aead_ctx );
+    }
+
+    free ( stream->aead_ctx );
+    stream->aead_ctx = NULL;
+    stream->aead = SC_AEAD_NONE;
+
+    if ( stream->record )
+    {
+        memset ( stream->record, '\0', SC_RECORD_BUFSIZE );
+        free ( stream->record );
+        stream->record = NULL;
+    }
+}
+
+/**
+ * Build record nonce from salt and sequence number
+ */
+static void sc_aead_nonce ( const struct sc_stream_t *stream, uint8_t * nonce )
+{
+    int i;
+
+    memcpy ( nonce, stream->salt, SC_AEAD_NONCELEN );
+
+    for ( i = 0; i < 8; i++ )
+    {
+        nonce[SC_AEAD_NONCELEN - 1 - i] ^= ( stream->seq >> ( 8 * i ) ) & 0xff;
+    }
+}
+
+/**
+ * Encrypt record in place, length header is authenticated
+ */
+static int sc_aead_seal ( struct sc_stream_t *stream, uint8_t * record, int len )
+{
+    int status;
+    uint8_t nonce[SC_AEAD_NONCELEN];
+
+    sc_aead_nonce ( stream, nonce );
+
+    if ( stream->aead == SC_AEAD_GCM )
+    {
+        status =
+            mbedtls_gcm_crypt_and_tag ( stream->aead_ctx, MBEDTLS_GCM_ENCRYPT, len, nonce,
+            SC_AEAD_NONCELEN, record, 2, record + 2, record + 2, SC_AEAD_TAGLEN,
+            record + 2 + len );
+
+    } else
+    {
+        status =
+            mbedtls_chachapoly_encrypt_and_tag ( stream->aead_ctx, len, nonce, record, 2,
+            record + 2, record + 2, record + 2 + len );
+    }
+
+    stream->seq++;
+
+    return status != 0 ? -1 : 0;
+}
+
+/**
+ * Verify and decrypt record
+ */
+static int sc_aead_open ( struct sc_stream_t *stream, const uint8_t * record, int len,
+    uint8_t * dst )
+{
+    int status;
+    uint8_t nonce[SC_AEAD_NONCELEN];
+
+    sc_aead_nonce ( stream, nonce );
+
+    if ( stream->aead == SC_AEAD_GCM )
+    {
+        status =
+            mbedtls_gcm_auth_decrypt ( stream->aead_ctx, len, nonce, SC_AEAD_NONCELEN, record, 2,
+            record + 2 + len, SC_AEAD_TAGLEN, record + 2, dst );
+
+    } else
+    {
+        status =
+            mbedtls_chachapoly_auth_decrypt ( stream->aead_ctx, len, nonce, record, 2,
+            record + 2 + len, record + 2, dst );
+    }
+
+    stream->seq++;
+
+    return status != 0 ? -1 : 0;
+}
+
+/**
+ * Decrypt all complete records gathered so far
+ */
+static int sc_aead_open_records ( struct sc_stream_t *stream, uint8_t * dst, int *outlen )
+{
+    int plen;
+    int ipos = 0;
+    int opos = 0;
+
+    /* Per-direction nonce follows the marker block */
+    if ( ~stream->flags & SC_STREAM_RECV_RXSALT )
+    {
+        if ( stream->record_len < AES256_BLOCKLEN )
+        {
+            *outlen = 0;
+            return 0;
+        }
+
+        memcpy ( stream->salt, stream->record, SC_AEAD_NONCELEN );
+        ipos += AES256_BLOCKLEN;
+        stream->flags |= SC_STREAM_RECV_RXSALT;
+    }
+
+    while ( stream->record_len - ipos >= 2 )
+    {
+        plen = ( stream->record[ipos] << 8 ) | stream->record[ipos + 1];
+
+        if ( stream->record_len - ipos < 2 + plen + SC_AEAD_TAGLEN )
+        {
+            break;
+        }
+
+        /* Corrupt or forged record drops the stream */
+        if ( sc_aead_open ( stream, stream->record + ipos, plen, dst + opos ) < 0 )
+        {
+            return -1;
+        }
+
+        ipos += 2 + plen + SC_AEAD_TAGLEN;
+        opos += plen;
+    }
+
+    /* Keep leftover partial record */
+    stream->record_len -= ipos;
+    memmove ( stream->record, stream->record + ipos, stream->record_len );
+
+    *outlen = opos;
+
+    return 0;
+}
+
+/**
+ * Switch receiving stream to wire v2 after its marker block
+ */
+static int sc_aead_begin ( struct sc_stream_t *stream, int aead, const uint8_t * data, int len,
+    int *outlen )
+{
+    uint8_t *ring;
+
+    if ( sc_aead_setup ( stream, aead ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( !( stream->record = malloc ( SC_RECORD_BUFSIZE ) ) )
+    {
+        return -1;
+    }
+
+    memcpy ( stream->record, data, len );
+    stream->record_len = len;
+    stream->flags |= SC_STREAM_RECV_RXNONCE;
+
+    /* Ring must hold any record, it is still empty at this point */
+    if ( stream->ring_size < SC_RECORD_BUFSIZE )
+    {
+        if ( !( ring = realloc ( stream->ring, SC_RECORD_BUFSIZE ) ) )
+        {
+            return -1;
+        }
+
+        stream->ring = ring;
+        stream->ring_size = SC_RECORD_BUFSIZE;
+    }
+
+    return sc_aead_open_records ( stream, stream->ring, outlen );
+}
+
+/**
+ * Find wire v2 cipher by marker block
+ */
+static int sc_aead_detect ( const struct sc_context_t *context, const uint8_t * block )
+{
+    int aead;
+
+    for ( aead = SC_AEAD_GCM; aead < SC_AEAD_COUNT; aead++ )
+    {
+        if ( !memcmp ( block, context->aead_marker[aead], AES256_BLOCKLEN ) )
+        {
+            return aead;
+        }
+    }
+
+    return SC_AEAD_NONE;
+}
+
+/**
+ * Create new SC stream
+ */
+int sc_new_stream ( struct sc_stream_t *stream, struct sc_context_t *context, int encrypt )
+{
+    memset ( stream, '\0', sizeof ( struct sc_stream_t ) );
+
+    if ( encrypt )
+    {
+        if ( sc_take_nonce ( context, stream->iv ) < 0 )
+        {
+            return -1;
+        }
+    }
+
+    stream->context = context;
+    stream->engine = context->engine;
+    stream->ring_size = context->ring_size;
+
+    if ( !( stream->ring = ( uint8_t * ) malloc ( stream->ring_size ) ) )
+    {
+        return -1;
+    }
+
+    stream->flags = SC_STREAM_INITIALIZED;
+
+    if ( encrypt )
+    {
+        stream->flags |= SC_STREAM_ENCRYPT_MODE;
+
+        /* Receiver tells the wire version from the first block */
+        if ( context->aead != SC_AEAD_NONE )
+        {
+            if ( sc_aead_setup ( stream, context->aead ) < 0 )
+            {
+                free ( stream->ring );
+                stream->flags = 0;
+                return -1;
+            }
+
+            memcpy ( stream->salt, stream->iv, SC_AEAD_NONCELEN );
+        }
+
+        /* Chunks over the short length limit go out as jumbo frames, records stay short */
+        if ( !stream->aead && context->chunk_len > SC_FRAME_SHORT_MAX )
+        {
+            stream->flags |= SC_STREAM_JUMBO;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Encrypt or decrypt blocks in CBC mode
+ */
+static int sc_crypt_cbc ( struct sc_stream_t *stream, int len, const uint8_t * src, uint8_t * dst )
+{
+    return stream->engine->crypt ( stream, len, src, dst );
+}
+
+/**
+ * Queue frame for encryption along with other streams
+ */
+static void sc_batch_queue ( struct sc_stream_t *stream, uint8_t * frame, int len )
+{
+    struct sc_batch_t *batch = &stream->context->batch;
+    struct aesni_lane_t *lane = &batch->lanes[batch->count];
+
+    lane->iv = stream->iv;
+    lane->src = frame;
+    lane->dst = frame;
+    lane->len = len;
+    batch->streams[batch->count++] = stream;
+    stream->flags |= SC_STREAM_BATCHED;
+}
+
+/**
+ * Encrypt all frames waiting in the batch
+ */
+void sc_batch_flush ( struct sc_context_t *context )
+{
+    int i;
+    struct sc_batch_t *batch = &context->batch;
+
+    if ( !batch->count )
+    {
+        return;
+    }
+
+    context->engine->encrypt_lanes ( context, batch->lanes, batch->count );
+
+    for ( i = 0; i < batch->count; i++ )
+    {
+        batch->streams[i]->flags &= ~SC_STREAM_BATCHED;
+    }
+
+    batch->count = 0;
+}
+
+/**
+ * Drop stream from the batch without encrypting its frame
+ */
+static void sc_batch_remove ( struct sc_stream_t *stream )
+{
+    int i;
+    struct sc_batch_t *batch = &stream->context->batch;
+
+    for ( i = 0; i < batch->count; i++ )
+    {
+        if ( batch->streams[i] == stream )
+        {
+            batch->count--;
+            batch->streams[i] = batch->streams[batch->count];
+            batch->lanes[i] = batch->lanes[batch->count];
+            break;
+        }
+    }
+
+    stream->flags &= ~SC_STREAM_BATCHED;
+}
+
+/**
+ * Get frame length header size, jumbo frames escape to a 32-bit length
+ */
+static int sc_frame_header_len ( const struct sc_stream_t *stream )
+{
+    return stream->flags & SC_STREAM_JUMBO ? 6 : 2;
+}
+
+/**
+ * Get room needed around incoming traffic data
+ */
+static void sc_input_reserve ( const struct sc_stream_t *stream, int *before, int *after )
+{
+    if ( stream->flags & SC_STREAM_ENCRYPT_MODE )
+    {
+        /* Wire v2 has marker and nonce blocks in front, tag behind */
+        if ( stream->aead )
+        {
+            *before = ~stream->flags & SC_STREAM_SENT_TXNONCE ? 2 * AES256_BLOCKLEN + 2 : 2;
+            *before += stream->pending_len;
+            *after = SC_AEAD_TAGLEN;
+            return;
+        }
+
+        /* Nonce, length header and held small reads in front, padding behind */
+        *before = sc_frame_header_len ( stream ) + stream->pending_len;
+        *before += ~stream->flags & SC_STREAM_SENT_TXNONCE ? AES256_BLOCKLEN : 0;
+        *after = AES256_BLOCKLEN - 1;
+
+    } else
+    {
+        /* Leftover partial block in front */
+        *before = stream->unconsumed_len;
+        *after = 0;
+    }
+}
+
+/**
+ * Find ring room for incoming traffic data
+ */
+static int sc_ring_room ( const struct sc_stream_t *stream, int need, int *pos )
+{
+    int room;
+
+    /* Data wrapped around, free space is between tail and head */
+    if ( stream->ring_wrap )
+    {
+        *pos = stream->ring_tail;
+        return stream->ring_head - stream->ring_tail;
+    }
+
+    room = stream->ring_size - stream->ring_tail;
+
+    /* Wrap around if tail cannot take a whole chunk and ring start offers more room */
+    if ( room < stream->context->chunk_len + need && room < stream->ring_head
+        && stream->ring_head >= need )
+    {
+        *pos = 0;
+        return stream->ring_head;
+    }
+
+    *pos = stream->ring_tail;
+    return room;
+}
+
+/**
+ * Get buffer for incoming traffic data
+ */
+uint8_t *sc_input_buffer ( struct sc_stream_t *stream, int *len )
+{
+    int pos;
+    int max;
+    int room;
+    int before;
+    int after;
+
+    /* Wire v2 records are gathered aside until complete */
+    if ( stream->record )
+    {
+        room = sc_ring_room ( stream, stream->record_len + 1, &pos );
+        *len = SC_RECORD_BUFSIZE - stream->record_len;
+
+        if ( *len > room - stream->record_len )
+        {
+            *len = room - stream->record_len;
+        }
+
+        if ( *len <= 0 )
+        {
+            *len = 0;
+            return NULL;
+        }
+
+        return stream->record + stream->record_len;
+    }
+
+    sc_input_reserve ( stream, &before, &after );
+    room = sc_ring_room ( stream, before + after + 1, &pos );
+
+    if ( ( *len = room - before - after ) <= 0 )
+    {
+        *len = 0;
+        return NULL;
+    }
+
+    if ( stream->flags & SC_STREAM_ENCRYPT_MODE )
+    {
+        max = ( stream->flags & SC_STREAM_JUMBO ? SC_FRAME_MAX : SC_FRAME_SHORT_MAX )
+            - stream->pending_len;
+
+        if ( *len > max )
+        {
+            *len = max;
+        }
+
+    } else
+    {
+        memcpy ( stream->ring + pos, stream->unconsumed, stream->unconsumed_len );
+    }
+
+    return stream->ring + pos + before;
+}
+
+/**
+ * Encrypt traffic data
+ */
+static int sc_encrypt_data ( struct sc_stream_t *stream, uint8_t * buf, int len, int *outlen )
+{
+    int flen;
+    int hlen;
+    uint8_t *frame = buf;
+
+    if ( len > ( stream->flags & SC_STREAM_JUMBO ? SC_FRAME_MAX : SC_FRAME_SHORT_MAX ) )
+    {
+        return -1;
+    }
+
+    if ( stream->aead )
+    {
+        /* Marker and nonce go in front of the first record */
+        if ( ~stream->flags & SC_STREAM_SENT_TXNONCE )
+        {
+            memcpy ( buf, stream->context->aead_marker[stream->aead], AES256_BLOCKLEN );
+            memcpy ( buf + AES256_BLOCKLEN, stream->iv, AES256_BLOCKLEN );
+            frame += 2 * AES256_BLOCKLEN;
+            stream->flags |= SC_STREAM_SENT_TXNONCE;
+        }
+
+        /* Record is length header, data and tag */
+        frame[0] = ( len & 0xff00 ) >> 8;
+        frame[1] = len & 0xff;
+
+        if ( sc_aead_seal ( stream, frame, len ) < 0 )
+        {
+            return -1;
+        }
+
+        *outlen = frame - buf + 2 + len + SC_AEAD_TAGLEN;
+
+        return 0;
+    }
+
+    /* Nonce goes in front of the first frame */
+    if ( ~stream->flags & SC_STREAM_SENT_TXNONCE )
+    {
+        memcpy ( buf, stream->iv, AES256_BLOCKLEN );
+        frame += AES256_BLOCKLEN;
+        stream->flags |= SC_STREAM_SENT_TXNONCE;
+    }
+
+    /* Frame is length header and data, zero-padded to the block boundary */
+    hlen = sc_frame_header_len ( stream );
+    flen = ( hlen + len + AES256_BLOCKLEN - 1 ) & ~( AES256_BLOCKLEN - 1 );
+
+    if ( stream->flags & SC_STREAM_JUMBO )
+    {
+        /* Zero short length is never sent otherwise */
+        frame[0] = 0;
+        frame[1] = 0;
+        frame[2] = ( len >> 24 ) & 0xff;
+        frame[3] = ( len >> 16 ) & 0xff;
+        frame[4] = ( len >> 8 ) & 0xff;
+        frame[5] = len & 0xff;
+
+    } else
+    {
+        frame[0] = ( len & 0xff00 ) >> 8;
+        frame[1] = len & 0xff;
+    }
+
+    memset ( frame + hlen + len, '\0', flen - hlen - len );
+
+    /* Encrypt whole frame at once in place, or along with other streams */
+    if ( stream->flags & SC_STREAM_DEFERRED )
+    {
+        sc_batch_queue ( stream, frame, flen );
+
+    } else if ( sc_crypt_cbc ( stream, flen, frame, frame ) < 0 )
+    {
+        return -1;
+    }
+
+    *outlen = frame - buf + flen;
+
+    return 0;
+}
+
+/**
+ * Decrypt traffic data
+ */
+static int sc_decrypt_data ( struct sc_stream_t *stream, uint8_t * buf, int len, int *outlen )
+{
+    int aead;
+    int hlen;
+    int vlen;
+    uint32_t jlen;
+    int ipos = 0;
+    int opos = 0;
+    uint8_t block[AES256_BLOCKLEN];
+
+    /* Take nonce from the first block, unless it marks wire v2 */
+    if ( ~stream->flags & SC_STREAM_RECV_RXNONCE && len >= AES256_BLOCKLEN )
+    {
+        if ( ( aead = sc_aead_detect ( stream->context, buf ) ) != SC_AEAD_NONE )
+        {
+            return sc_aead_begin ( stream, aead, buf + AES256_BLOCKLEN, len - AES256_BLOCKLEN,
+                outlen );
+        }
+
+        memcpy ( stream->iv, buf, AES256_BLOCKLEN );
+        ipos += AES256_BLOCKLEN;
+        stream->flags |= SC_STREAM_RECV_RXNONCE;
+    }
+
+    while ( len - ipos >= AES256_BLOCKLEN )
+    {
+        if ( !stream->expected_len )
+        {
+            /* Frame header block is decrypted aside */
+            if ( sc_crypt_cbc ( stream, AES256_BLOCKLEN, buf + ipos, block ) < 0 )
+            {
+                return -1;
+            }
+
+            stream->expected_len = ( block[0] << 8 ) | block[1];
+            hlen = 2;
+
+            /* Zero short length escapes to jumbo frame length */
+            if ( !stream->expected_len )
+            {
+                jlen = ( ( uint32_t ) block[2] << 24 ) | ( block[3] << 16 ) | ( block[4] << 8 )
+                    | block[5];
+
+                if ( jlen > SC_FRAME_MAX )
+                {
+                    return -1;
+                }
+
+                stream->expected_len = jlen;
+                hlen = 6;
+            }
+
+            vlen =
+                stream->expected_len >
+                AES256_BLOCKLEN - hlen ? AES256_BLOCKLEN - hlen : stream->expected_len;
+            memcpy ( buf + opos, block + hlen, vlen );
+            ipos += AES256_BLOCKLEN;
+            opos += vlen;
+            stream->expected_len -= vlen;
+            continue;
+        }
+
+        /* Frame data blocks are decrypted at once over stripped headers and padding */
+        vlen = ( stream->expected_len + AES256_BLOCKLEN - 1 ) & ~( AES256_BLOCKLEN - 1 );
+
+        if ( vlen > len - ipos )
+        {
+            vlen = ( len - ipos ) & ~( AES256_BLOCKLEN - 1 );
+        }
+
+        if ( sc_crypt_cbc ( stream, vlen, buf + ipos, buf + opos ) < 0 )
+        {
+            return -1;
+        }
+
+        ipos += vlen;
+
+        if ( vlen > stream->expected_len )
+        {
+            vlen = stream->expected_len;
+        }
+
+        opos += vlen;
+        stream->expected_len -= vlen;
+    }
+
+    /* Keep leftover partial block */
+    stream->unconsumed_len = len - ipos;
+    memcpy ( stream->unconsumed, buf + ipos, stream->unconsumed_len );
+
+    *outlen = opos;
+
+    return 0;
+}
+
+/**
+ * Get monotonic time in microseconds
+ */
+uint64_t sc_clock_usec ( void )
+{
+    struct timespec now;
+
+    clock_gettime ( CLOCK_MONOTONIC, &now );
+
+    return ( uint64_t ) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Hold small read back to merge it with the next ones
+ */
+static int sc_coalesce_hold ( struct sc_stream_t *stream, const uint8_t * data, int len,
+    int held )
+{
+    uint64_t now;
+    const struct sc_context_t *context = stream->context;
+
+    if ( !context->coalesce_usec || len >= context->coalesce_bytes )
+    {
+        return 0;
+    }
+
+    now = sc_clock_usec (  );
+
+    if ( held )
+    {
+        /* Window runs from the first held read */
+        if ( now - stream->pending_usec >= ( uint64_t ) context->coalesce_usec )
+        {
+            return 0;
+        }
+
+    } else
+    {
+        /* Lone small read after a quiet spell looks interactive */
+        if ( now - stream->small_usec >= ( uint64_t ) context->coalesce_usec )
+        {
+            stream->small_usec = now;
+            return 0;
+        }
+
+        stream->pending_usec = now;
+    }
+
+    stream->small_usec = now;
+
+    if ( !stream->pending && !( stream->pending = malloc ( context->coalesce_bytes ) ) )
+    {
+        return 0;
+    }
+
+    memcpy ( stream->pending, data, len );
+    stream->pending_len = len;
+
+    return 1;
+}
+
+/**
+ * Process traffic data in place
+ */
+int sc_process_data ( struct sc_stream_t *stream, int len )
+{
+    int pos;
+    int held;
+    int room;
+    int before;
+    int after;
+    int outlen;
+    int status;
+
+    if ( ~stream->flags & SC_STREAM_INITIALIZED || stream->flags & SC_STREAM_ERROR_STATE )
+    {
+        return -1;
+    }
+
+    if ( stream->record )
+    {
+        if ( len <= 0 || len > SC_RECORD_BUFSIZE - stream->record_len )
+        {
+            return -1;
+        }
+
+        /* Same placement as handed out by sc_input_buffer */
+        room = sc_ring_room ( stream, stream->record_len + 1, &pos );
+        stream->record_len += len;
+
+        if ( stream->record_len > room )
+        {
+            stream->record_len -= len;
+            return -1;
+        }
+
+        status = sc_aead_open_records ( stream, stream->ring + pos, &outlen );
+
+        if ( status >= 0 && stream->ring_hiwat < pos + outlen )
+        {
+            stream->ring_hiwat = pos + outlen;
+        }
+
+    } else
+    {
+        sc_input_reserve ( stream, &before, &after );
+        room = sc_ring_room ( stream, before + after + 1, &pos );
+
+        /* Empty input only flushes held small reads */
+        if ( len < 0 || ( !len && !stream->pending_len ) || len > room - before - after )
+        {
+            return -1;
+        }
+
+        if ( stream->ring_hiwat < pos + before + len + after )
+        {
+            stream->ring_hiwat = pos + before + len + after;
+        }
+
+        if ( stream->flags & SC_STREAM_ENCRYPT_MODE )
+        {
+            /* Held small reads go in front of the new data */
+            if ( ( held = stream->pending_len ) )
+            {
+                before -= held;
+                memcpy ( stream->ring + pos + before, stream->pending, held );
+                len += held;
+                stream->pending_len = 0;
+            }
+
+            if ( stream->flags & SC_STREAM_HOLDING
+                && sc_coalesce_hold ( stream, stream->ring + pos + before, len, held ) )
+            {
+                return 0;
+            }
+
+            status = sc_encrypt_data ( stream, stream->ring + pos, len, &outlen );
+
+            if ( status >= 0 )
+            {
+                stream->plain_bytes += len;
+                stream->wire_bytes += outlen;
+            }
+
+        } else
+        {
+            status = sc_decrypt_data ( stream, stream->ring + pos, before + len, &outlen );
+        }
+    }
+
+    if ( status < 0 )
+    {
+        stream->flags |= SC_STREAM_ERROR_STATE;
+        return -1;
+    }
+
+    if ( outlen )
+    {
+        if ( pos != stream->ring_tail )
+        {
+            stream->ring_wrap = stream->ring_tail;
+        }
+
+        stream->ring_tail = pos + outlen;
+    }
+
+    return 0;
+}
+
+/**
+ * Process traffic data from the event loop, small reads may be held back
+ * and encryption may wait for sc_batch_flush
+ */
+int sc_process_batched ( struct sc_stream_t *stream, int len )
+{
+    int status;
+    struct sc_context_t *context = stream->context;
+
+    /* Held reads are flushed by the event loop timer only */
+    stream->flags |= SC_STREAM_HOLDING;
+
+    /* Only CBC frames of lane-capable engines are batched */
+    if ( stream->flags & SC_STREAM_ENCRYPT_MODE && !stream->aead
+        && stream->engine == context->engine && context->engine->encrypt_lanes )
+    {
+        /* Next frame chains on ciphertext of the pending one */
+        if ( stream->flags & SC_STREAM_BATCHED || context->batch.count == SC_BATCH_SIZE )
+        {
+            sc_batch_flush ( context );
+        }
+
+        stream->flags |= SC_STREAM_DEFERRED;
+    }
+
+    status = sc_process_data ( stream, len );
+    stream->flags &= ~( SC_STREAM_DEFERRED | SC_STREAM_HOLDING );
+
+    return status;
+}
+
+/**
+ * Frame small reads held back by the stream
+ */
+int sc_flush_pending ( struct sc_stream_t *stream )
+{
+    int len;
+
+    if ( !stream->pending_len )
+    {
+        return 0;
+    }
+
+    /* Frame chains on ciphertext of the batched one */
+    if ( stream->flags & SC_STREAM_BATCHED )
+    {
+        sc_batch_flush ( stream->context );
+    }
+
+    /* Retried later once sent data makes room */
+    if ( !sc_input_buffer ( stream, &len ) )
+    {
+        return 1;
+    }
+
+    return sc_process_data ( stream, 0 );
+}
+
+/**
+ * Get processed data ready to be sent
+ */
+uint8_t *sc_output_data ( struct sc_stream_t *stream, int *len )
+{
+    /* Frame is still plaintext until its batch is encrypted */
+    if ( stream->flags & SC_STREAM_BATCHED )
+    {
+        sc_batch_flush ( stream->context );
+    }
+
+    *len = ( stream->ring_wrap ? stream->ring_wrap : stream->ring_tail ) - stream->ring_head;
+
+    return *len ? stream->ring + stream->ring_head : NULL;
+}
+
+/**
+ * Get processed data wrapped around to the ring start
+ */
+uint8_t *sc_output_wrapped ( struct sc_stream_t *stream, int *len )
+{
+    *len = stream->ring_wrap ? stream->ring_tail : 0;
+
+    return *len ? stream->ring : NULL;
+}
+
+/**
+ * Mark processed data as sent, possibly past the wrap point
+ */
+void sc_consume_data ( struct sc_stream_t *stream, int len )
+{
+    if ( stream->ring_wrap && stream->ring_head + len >= stream->ring_wrap )
+    {
+        len -= stream->ring_wrap - stream->ring_head;
+        stream->ring_head = 0;
+        stream->ring_wrap = 0;
+    }
+
+    stream->ring_head += len;
+
+    /* Rewind empty ring */
+    if ( !stream->ring_wrap && stream->ring_head == stream->ring_tail )
+    {
+        stream->ring_head = 0;
+        stream->ring_tail = 0;
+    }
+}
+
+/**
+ * Check if processed data is pending
+ */
+int sc_has_output ( const struct sc_stream_t *stream )
+{
+    return stream->ring_wrap || stream->ring_head != stream->ring_tail;
+}
+
+/**
+ * Uninitialize SC stream
+ */
+void sc_free_stream ( struct sc_stream_t *stream )
+{
+    if ( stream->flags & SC_STREAM_INITIALIZED )
+    {
+        memset ( stream->unconsumed, '\0', sizeof ( stream->unconsumed ) );
+        memset ( stream->ring, '\0', stream->ring_hiwat );
+        free ( stream->ring );
+
+        /* Engine is kept by the stream, context may be gone already */
+        if ( stream->engine->release )
+        {
+            stream->engine->release ( stream );
+        }
+
+        if ( stream->flags & SC_STREAM_BATCHED )
+        {
+            sc_batch_remove ( stream );
+        }
+
+        if ( stream->pending )
+        {
+            memset ( stream->pending, '\0', stream->context->coalesce_bytes );
+            free ( stream->pending );
+            stream->pending = NULL;
+            stream->pending_len = 0;
+        }
+
+        sc_aead_release ( stream );
         stream->flags = 0;
     }
 }
@@ -0,0 +1,361 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Kernel TLS Offload Source Code
+ * ------------------------------------------------------------------ */
+
+#define _GNU_SOURCE
+
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#include "ktls.h"
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+/**
+ * Attach kernel TLS layer to the socket
+ */
+static int ktls_attach ( int sock )
+{
+    /* Layer stays attached, later calls only add keys */
+    if ( setsockopt ( sock, SOL_TCP, TCP_ULP, "tls", sizeof ( "tls" ) ) < 0 && errno != EEXIST )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Install TLS 1.3 AES-256-GCM key for one direction
+ */
+static int ktls_set_key ( int sock, int dir, const uint8_t * key, const uint8_t * iv )
+{
+    int status;
+    struct tls12_crypto_info_aes_gcm_256 info;
+
+    memset ( &info, '\0', sizeof ( info ) );
+    info.info.version = TLS_1_3_VERSION;
+    info.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+    memcpy ( info.salt, iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE );
+    memcpy ( info.iv, iv + TLS_CIPHER_AES_GCM_256_SALT_SIZE, TLS_CIPHER_AES_GCM_256_IV_SIZE );
+    memcpy ( info.key, key, TLS_CIPHER_AES_GCM_256_KEY_SIZE );
+
+    status = setsockopt ( sock, SOL_TLS, dir, &info, sizeof ( info ) );
+    memset ( &info, '\0', sizeof ( info ) );
+
+    return status;
+}
+
+/**
+ * Create splice pipe for data received by the stream
+ */
+static int ktls_splice_setup ( struct stream_t *stream )
+{
+    if ( pipe2 ( stream->splice_fds, O_NONBLOCK | O_CLOEXEC ) < 0 )
+    {
+        return -1;
+    }
+
+    stream->splice_len = 0;
+    stream->ktls |= KTLS_SPLICE;
+
+    return 0;
+}
+
+/**
+ * Start kernel TLS on a freshly bound relation
+ */
+int ktls_bind ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int len;
+    struct stream_t *tunnel;
+    uint8_t hello[SC_KTLS_HELLOLEN];
+    uint8_t key[AES256_KEYLEN];
+    uint8_t iv[SC_KTLS_SALTLEN + SC_KTLS_IVLEN];
+
+    /* Tunnel socket is the one carrying encrypted data in */
+    tunnel = stream->sc.flags & SC_STREAM_ENCRYPT_MODE ? stream->neighbour : stream;
+
+    /* Peer may offload its sending side whatever we do, costs one recv */
+    tunnel->ktls = KTLS_PROBE;
+
+    if ( !proxy->use_ktls )
+    {
+        return 0;
+    }
+
+    if ( ktls_attach ( tunnel->fd ) < 0 )
+    {
+        failure ( "kernel tls unavailable (%i), using userspace crypto\n", errno );
+        proxy->use_ktls = FALSE;
+        return 0;
+    }
+
+    if ( sc_ktls_hello ( &proxy->sc_context, hello, key, iv ) < 0 )
+    {
+        return -1;
+    }
+
+    /* Hello goes out in clear, fresh socket always takes it whole */
+    len = send ( tunnel->fd, hello, sizeof ( hello ), MSG_NOSIGNAL );
+    tunnel->nsyscalls++;
+
+    if ( len != sizeof ( hello ) || ktls_set_key ( tunnel->fd, TLS_TX, key, iv ) < 0
+        || ktls_splice_setup ( tunnel->neighbour ) < 0 )
+    {
+        failure ( "cannot start kernel tls on socket:%i\n", tunnel->fd );
+        memset ( key, '\0', sizeof ( key ) );
+        memset ( iv, '\0', sizeof ( iv ) );
+        return -1;
+    }
+
+    memset ( key, '\0', sizeof ( key ) );
+    memset ( iv, '\0', sizeof ( iv ) );
+
+    verbose ( "kernel tls sending on socket:%i\n", tunnel->fd );
+
+    return 0;
+}
+
+/**
+ * Pass non kernel TLS hello on to stream crypto
+ */
+static int ktls_hello_feed ( struct stream_t *stream )
+{
+    int len;
+    uint8_t *buffer;
+
+    if ( !( buffer = sc_input_buffer ( &stream->sc, &len ) ) || len < stream->hello_len )
+    {
+        return -1;
+    }
+
+    memcpy ( buffer, stream->hello, stream->hello_len );
+
+    if ( sc_process_data ( &stream->sc, stream->hello_len ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( sc_has_output ( &stream->sc ) )
+    {
+        stream->neighbour->events |= POLLOUT;
+    }
+
+    return 0;
+}
+
+/**
+ * Receive leading hello and offload receiving side if requested
+ */
+static int ktls_probe ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int len;
+    int want;
+    int status;
+    uint8_t key[AES256_KEYLEN];
+    uint8_t iv[SC_KTLS_SALTLEN + SC_KTLS_IVLEN];
+
+    /* Nothing past the hello may be read before the key is installed */
+    want = SC_KTLS_HELLOLEN - stream->hello_len;
+    len = recv ( stream->fd, stream->hello + stream->hello_len, want, 0 );
+    stream->nsyscalls++;
+
+    if ( len < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+    {
+        stream_would_block ( stream, POLLIN );
+        return 0;
+    }
+
+    /* Hello cut short carries no complete frame */
+    if ( !len )
+    {
+        verbose ( "socket:%i reached end of data\n", stream->fd );
+        stream->eof = 1;
+        stream->events &= ~POLLIN;
+        stream_would_block ( stream, POLLIN );
+        return 0;
+    }
+
+    if ( len < 0 )
+    {
+        failure ( "cannot receive data (%i) from socket:%i\n", errno, stream->fd );
+        return -1;
+    }
+
+    stream->nbytes += len;
+    proxy->nbytes += len;
+    stream->hello_len += len;
+
+    /* End of stream queued behind the data is read in the next cycle */
+    if ( len < want )
+    {
+        if ( ~stream->lrevents & POLLRDHUP )
+        {
+            stream_would_block ( stream, POLLIN );
+        }
+        return 0;
+    }
+
+    stream->ktls &= ~KTLS_PROBE;
+
+    /* Userspace wire formats start with at least a hello worth of data */
+    if ( sc_ktls_accept ( &proxy->sc_context, stream->hello, key, iv ) < 0 )
+    {
+        status = ktls_hello_feed ( stream );
+
+    } else
+    {
+        status = ktls_attach ( stream->fd ) < 0 || ktls_set_key ( stream->fd, TLS_RX, key, iv ) < 0
+            || ktls_splice_setup ( stream ) < 0 ? -1 : 0;
+    }
+
+    memset ( stream->hello, '\0', sizeof ( stream->hello ) );
+    memset ( key, '\0', sizeof ( key ) );
+    memset ( iv, '\0', sizeof ( iv ) );
+
+    if ( status < 0 )
+    {
+        failure ( "cannot set up receiving (%i) on socket:%i\n", errno, stream->fd );
+        return -1;
+    }
+
+    if ( stream->ktls & KTLS_SPLICE )
+    {
+        verbose ( "kernel tls receiving on socket:%i\n", stream->fd );
+    }
+
+    return 0;
+}
+
+/**
+ * Splice received data into the stream pipe
+ */
+static int ktls_splice_in ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    ssize_t len;
+
+    len = splice ( stream->fd, NULL, stream->splice_fds[1], NULL, proxy->sc_context.chunk_len,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+    stream->nsyscalls++;
+
+    if ( len < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+    {
+        /* Either pipe is full or socket is drained */
+        if ( stream->splice_len )
+        {
+            stream->events &= ~POLLIN;
+
+        } else
+        {
+            stream_would_block ( stream, POLLIN );
+        }
+
+        return 0;
+    }
+
+    if ( !len )
+    {
+        verbose ( "socket:%i reached end of data\n", stream->fd );
+        stream->eof = 1;
+        stream->events &= ~POLLIN;
+        stream_would_block ( stream, POLLIN );
+        return 0;
+    }
+
+    if ( len < 0 )
+    {
+        failure ( "cannot splice data (%i) from socket:%i\n", errno, stream->fd );
+        return -1;
+    }
+
+    stream->nbytes += len;
+    proxy->nbytes += len;
+    stream->splice_len += len;
+
+    verbose ( "bytes spliced from socket:%i count %i\n", stream->fd, ( int ) len );
+
+    stream->neighbour->events |= POLLOUT;
+
+    return 0;
+}
+
+/**
+ * Receive data on a kernel TLS aware stream
+ */
+int ktls_receive ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( stream->ktls & KTLS_PROBE )
+    {
+        return ktls_probe ( proxy, stream );
+    }
+
+    return ktls_splice_in ( proxy, stream );
+}
+
+/**
+ * Send data spliced from the neighbour stream
+ */
+int ktls_splice_out ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    ssize_t len;
+    struct stream_t *source = stream->neighbour;
+
+    if ( !source->splice_len )
+    {
+        stream->events &= ~POLLOUT;
+        return 0;
+    }
+
+    len = splice ( source->splice_fds[0], NULL, stream->fd, NULL, source->splice_len,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+    stream->nsyscalls++;
+
+    if ( len < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+    {
+        stream_would_block ( stream, POLLOUT );
+        return 0;
+    }
+
+    if ( len < 0 )
+    {
+        failure ( "cannot splice data to socket:%i\n", stream->fd );
+        return -1;
+    }
+
+    stream->nbytes += len;
+    proxy->nbytes += len;
+    source->splice_len -= len;
+
+    verbose ( "bytes spliced to socket:%i count %i\n", stream->fd, ( int ) len );
+
+    /* Drained pipe made room for receiving more */
+    if ( !source->eof )
+    {
+        source->events |= POLLIN;
+    }
+
+    if ( !source->splice_len )
+    {
+        stream->events &= ~POLLOUT;
+    }
+
+    return 0;
+}
+
+/**
+ * Release kernel TLS state of the stream
+ */
+void ktls_release ( struct stream_t *stream )
+{
+    if ( stream->ktls & KTLS_SPLICE )
+    {
+        close ( stream->splice_fds[0] );
+        close ( stream->splice_fds[1] );
+    }
+
+    memset ( stream->hello, '\0', sizeof ( stream->hello ) );
+    stream->ktls = 0;
+}
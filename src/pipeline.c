@@ -0,0 +1,697 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Crypto Pipeline Source Code
+ * ------------------------------------------------------------------ */
+
+#include <sys/eventfd.h>
+
+#include "pipeline.h"
+
+/**
+ * Allocate SPSC ring
+ */
+static int spsc_ring_init ( struct spsc_ring_t *ring, size_t size )
+{
+    if ( ( errno = posix_memalign ( ( void ** ) &ring->buf, SC_CACHELINE, size ) ) != 0 )
+    {
+        return -1;
+    }
+
+    ring->size = size;
+    ring->head = 0;
+    ring->tail = 0;
+
+    return 0;
+}
+
+/**
+ * Get contiguous room in SPSC ring, producer side
+ */
+static uint8_t *spsc_write_ptr ( struct spsc_ring_t *ring, size_t *len )
+{
+    size_t head = __atomic_load_n ( &ring->head, __ATOMIC_ACQUIRE );
+    size_t pos = ring->tail & ( ring->size - 1 );
+
+    *len = ring->size - ( ring->tail - head );
+
+    if ( *len > ring->size - pos )
+    {
+        *len = ring->size - pos;
+    }
+
+    return ring->buf + pos;
+}
+
+/**
+ * Publish written bytes, producer side
+ */
+static void spsc_write_commit ( struct spsc_ring_t *ring, size_t len )
+{
+    __atomic_store_n ( &ring->tail, ring->tail + len, __ATOMIC_RELEASE );
+}
+
+/**
+ * Get contiguous data in SPSC ring, consumer side
+ */
+static uint8_t *spsc_read_ptr ( struct spsc_ring_t *ring, size_t *len )
+{
+    size_t tail = __atomic_load_n ( &ring->tail, __ATOMIC_ACQUIRE );
+    size_t pos = ring->head & ( ring->size - 1 );
+
+    *len = tail - ring->head;
+
+    if ( *len > ring->size - pos )
+    {
+        *len = ring->size - pos;
+    }
+
+    return ring->buf + pos;
+}
+
+/**
+ * Release read bytes, consumer side
+ */
+static void spsc_read_release ( struct spsc_ring_t *ring, size_t len )
+{
+    __atomic_store_n ( &ring->head, ring->head + len, __ATOMIC_RELEASE );
+}
+
+/**
+ * Check if SPSC ring holds any data
+ */
+static int spsc_ring_empty ( struct spsc_ring_t *ring )
+{
+    return __atomic_load_n ( &ring->head, __ATOMIC_ACQUIRE )
+        == __atomic_load_n ( &ring->tail, __ATOMIC_ACQUIRE );
+}
+
+/**
+ * Check if SPSC ring has any room
+ */
+static int spsc_ring_full ( struct spsc_ring_t *ring )
+{
+    return __atomic_load_n ( &ring->tail, __ATOMIC_ACQUIRE )
+        - __atomic_load_n ( &ring->head, __ATOMIC_ACQUIRE ) == ring->size;
+}
+
+/**
+ * Wake crypto thread if it sleeps
+ */
+static void pipe_kick ( struct pipe_t *pipe )
+{
+    struct pipe_thread_t *thread = pipe->thread;
+
+    /* Pairs with the fence taken by the thread before it sleeps */
+    __atomic_thread_fence ( __ATOMIC_SEQ_CST );
+
+    if ( __atomic_load_n ( &thread->sleeping, __ATOMIC_RELAXED ) )
+    {
+        pthread_mutex_lock ( &thread->lock );
+        pthread_cond_signal ( &thread->cond );
+        pthread_mutex_unlock ( &thread->lock );
+    }
+}
+
+/**
+ * Get room for raw socket data
+ */
+uint8_t *pipe_input_buffer ( struct pipe_t *pipe, int *len )
+{
+    size_t room;
+    uint8_t *buffer;
+
+    buffer = spsc_write_ptr ( &pipe->input, &room );
+    *len = room;
+
+    return room ? buffer : NULL;
+}
+
+/**
+ * Pass raw socket data to worker thread
+ */
+void pipe_input_commit ( struct pipe_t *pipe, int len )
+{
+    spsc_write_commit ( &pipe->input, len );
+    pipe_kick ( pipe );
+}
+
+/**
+ * Get processed data ready to be sent
+ */
+uint8_t *pipe_output_data ( struct pipe_t *pipe, int *len )
+{
+    size_t avail;
+    uint8_t *buffer;
+
+    buffer = spsc_read_ptr ( &pipe->output, &avail );
+    *len = avail;
+
+    return avail ? buffer : NULL;
+}
+
+/**
+ * Get processed data wrapped around to the ring start
+ */
+uint8_t *pipe_output_wrapped ( struct pipe_t *pipe, int *len )
+{
+    struct spsc_ring_t *ring = &pipe->output;
+    size_t tail = __atomic_load_n ( &ring->tail, __ATOMIC_ACQUIRE );
+    size_t end = ring->size - ( ring->head & ( ring->size - 1 ) );
+
+    *len = tail - ring->head > end ? tail - ring->head - end : 0;
+
+    return *len ? ring->buf : NULL;
+}
+
+/**
+ * Mark processed data as sent
+ */
+void pipe_output_consume ( struct pipe_t *pipe, int len )
+{
+    spsc_read_release ( &pipe->output, len );
+    pipe_kick ( pipe );
+}
+
+/**
+ * Check if processed data is pending
+ */
+int pipe_has_output ( struct pipe_t *pipe )
+{
+    return !spsc_ring_empty ( &pipe->output );
+}
+
+/**
+ * Check if raw data is still being processed or waits to be sent
+ */
+int pipe_has_pending ( struct pipe_t *pipe )
+{
+    /* Input is released after output is published, so look at input first */
+    return !spsc_ring_empty ( &pipe->input ) || !spsc_ring_empty ( &pipe->output );
+}
+
+/**
+ * Move processed data from stream ring to output ring
+ */
+static int pipe_flush ( struct pipe_t *pipe )
+{
+    int len;
+    int progress = 0;
+    size_t room;
+    uint8_t *src;
+    uint8_t *dst;
+    struct sc_stream_t *sc = &pipe->stream->sc;
+
+    while ( ( src = sc_output_data ( sc, &len ) ) )
+    {
+        dst = spsc_write_ptr ( &pipe->output, &room );
+
+        if ( !room )
+        {
+            break;
+        }
+
+        if ( ( size_t ) len > room )
+        {
+            len = room;
+        }
+
+        memcpy ( dst, src, len );
+        spsc_write_commit ( &pipe->output, len );
+        sc_consume_data ( sc, len );
+        progress = 1;
+    }
+
+    /* Input stays queued until its output is, so pending data is never out of sight */
+    if ( pipe->held && !sc_has_output ( sc ) )
+    {
+        spsc_read_release ( &pipe->input, pipe->held );
+        pipe->held = 0;
+    }
+
+    return progress;
+}
+
+/**
+ * Process one chunk of raw data
+ */
+static int pipe_process ( struct pipe_t *pipe )
+{
+    int room;
+    int progress;
+    size_t len;
+    uint8_t *src;
+    uint8_t *dst;
+    struct sc_stream_t *sc = &pipe->stream->sc;
+
+    if ( __atomic_load_n ( &pipe->error, __ATOMIC_RELAXED ) )
+    {
+        return 0;
+    }
+
+    progress = pipe_flush ( pipe );
+
+    /* Stream ring is reused only once fully drained */
+    if ( sc_has_output ( sc ) )
+    {
+        return progress;
+    }
+
+    src = spsc_read_ptr ( &pipe->input, &len );
+
+    if ( !len || !( dst = sc_input_buffer ( sc, &room ) ) )
+    {
+        return progress;
+    }
+
+    if ( len > ( size_t ) room )
+    {
+        len = room;
+    }
+
+    if ( len > ( size_t ) sc->context->chunk_len )
+    {
+        len = sc->context->chunk_len;
+    }
+
+    memcpy ( dst, src, len );
+    pipe->held = len;
+
+    if ( sc_process_data ( sc, len ) < 0 )
+    {
+        __atomic_store_n ( &pipe->error, 1, __ATOMIC_RELEASE );
+        return 1;
+    }
+
+    pipe_flush ( pipe );
+
+    return 1;
+}
+
+/**
+ * Process all pipes of the thread once
+ */
+static int pipe_thread_pass ( struct pipe_thread_t *thread )
+{
+    int progress = 0;
+    uint64_t one = 1;
+    struct pipe_t *pipe;
+
+    for ( pipe = thread->head; pipe; pipe = pipe->thread_next )
+    {
+        if ( !pipe_process ( pipe ) )
+        {
+            continue;
+        }
+
+        progress = 1;
+
+        /* Event loop is woken once until it drains the notification */
+        if ( !__atomic_exchange_n ( &pipe->loop->notified, 1, __ATOMIC_ACQ_REL ) )
+        {
+            if ( write ( pipe->loop->event_fd, &one, sizeof ( one ) ) < 0 )
+            {
+                __atomic_store_n ( &pipe->loop->notified, 0, __ATOMIC_RELEASE );
+            }
+        }
+    }
+
+    return progress;
+}
+
+/**
+ * Crypto thread entry point
+ */
+static void *pipe_thread_main ( void *arg )
+{
+    struct pipe_thread_t *thread = ( struct pipe_thread_t * ) arg;
+
+    /* Pipes are only processed under the lock, so detaching waits for one pass at most */
+    pthread_mutex_lock ( &thread->lock );
+
+    while ( !thread->stop )
+    {
+        if ( pipe_thread_pass ( thread ) )
+        {
+            pthread_mutex_unlock ( &thread->lock );
+            pthread_mutex_lock ( &thread->lock );
+            continue;
+        }
+
+        /* Announce sleep, then look again so no input is missed */
+        __atomic_store_n ( &thread->sleeping, 1, __ATOMIC_RELAXED );
+        __atomic_thread_fence ( __ATOMIC_SEQ_CST );
+
+        if ( !pipe_thread_pass ( thread ) && !thread->stop )
+        {
+            pthread_cond_wait ( &thread->cond, &thread->lock );
+        }
+
+        __atomic_store_n ( &thread->sleeping, 0, __ATOMIC_RELAXED );
+    }
+
+    pthread_mutex_unlock ( &thread->lock );
+
+    return NULL;
+}
+
+/**
+ * Start crypto worker threads
+ */
+struct pipeline_t *pipeline_start ( int nthreads )
+{
+    int i;
+    struct pipeline_t *pipeline;
+
+    if ( !( pipeline = malloc ( sizeof ( struct pipeline_t ) ) ) )
+    {
+        return NULL;
+    }
+
+    if ( ( errno =
+            posix_memalign ( ( void ** ) &pipeline->threads, SC_CACHELINE,
+                nthreads * sizeof ( struct pipe_thread_t ) ) ) != 0 )
+    {
+        free ( pipeline );
+        return NULL;
+    }
+
+    memset ( pipeline->threads, '\0', nthreads * sizeof ( struct pipe_thread_t ) );
+
+    for ( i = 0; i < nthreads; i++ )
+    {
+        pipeline->threads[i].index = i;
+        pthread_mutex_init ( &pipeline->threads[i].lock, NULL );
+        pthread_cond_init ( &pipeline->threads[i].cond, NULL );
+
+        if ( ( errno =
+                pthread_create ( &pipeline->threads[i].thread, NULL, pipe_thread_main,
+                    &pipeline->threads[i] ) ) != 0 )
+        {
+            pthread_mutex_destroy ( &pipeline->threads[i].lock );
+            pthread_cond_destroy ( &pipeline->threads[i].cond );
+            pipeline->nthreads = i;
+            pipeline_stop ( pipeline );
+            return NULL;
+        }
+    }
+
+    pipeline->nthreads = nthreads;
+
+    return pipeline;
+}
+
+/**
+ * Stop crypto worker threads
+ */
+void pipeline_stop ( struct pipeline_t *pipeline )
+{
+    int i;
+    struct pipe_thread_t *thread;
+
+    for ( i = 0; i < pipeline->nthreads; i++ )
+    {
+        thread = &pipeline->threads[i];
+
+        pthread_mutex_lock ( &thread->lock );
+        thread->stop = 1;
+        pthread_cond_signal ( &thread->cond );
+        pthread_mutex_unlock ( &thread->lock );
+
+        pthread_join ( thread->thread, NULL );
+        pthread_mutex_destroy ( &thread->lock );
+        pthread_cond_destroy ( &thread->cond );
+    }
+
+    free ( pipeline->threads );
+    free ( pipeline );
+}
+
+/**
+ * Register pipeline events with the proxy
+ */
+int pipeline_attach ( struct proxy_t *proxy )
+{
+    struct pipe_loop_t *loop;
+    struct stream_t *stream;
+
+    if ( !( loop = calloc ( 1, sizeof ( struct pipe_loop_t ) ) ) )
+    {
+        return -1;
+    }
+
+    if ( ( loop->event_fd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 )
+    {
+        failure ( "cannot create pipeline event (%i)\n", errno );
+        free ( loop );
+        return -1;
+    }
+
+    if ( !( stream = insert_stream ( proxy, loop->event_fd ) ) )
+    {
+        close ( loop->event_fd );
+        free ( loop );
+        return -1;
+    }
+
+    stream->role = L_PIPELINE;
+    stream->events = POLLIN;
+    loop->event_stream = stream;
+    clock_gettime ( CLOCK_MONOTONIC, &loop->last_tick );
+    proxy->pipe_loop = loop;
+
+    return 0;
+}
+
+/**
+ * Unregister pipeline events from the proxy
+ */
+void pipeline_detach ( struct proxy_t *proxy )
+{
+    struct pipe_loop_t *loop = proxy->pipe_loop;
+
+    if ( !loop )
+    {
+        return;
+    }
+
+    /* Streams are removed first, event fd is closed along with its stream */
+    free ( loop );
+    proxy->pipe_loop = NULL;
+}
+
+/**
+ * Move stream crypto to the least busy worker thread
+ */
+static int pipe_create ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int i;
+    struct pipe_t *pipe;
+    struct pipe_thread_t *thread;
+    struct pipeline_t *pipeline = proxy->pipeline;
+
+    if ( !( pipe = calloc ( 1, sizeof ( struct pipe_t ) ) ) )
+    {
+        return -1;
+    }
+
+    if ( spsc_ring_init ( &pipe->input, PIPELINE_RING_SIZE ) < 0 )
+    {
+        free ( pipe );
+        return -1;
+    }
+
+    if ( spsc_ring_init ( &pipe->output, PIPELINE_RING_SIZE ) < 0 )
+    {
+        free ( pipe->input.buf );
+        free ( pipe );
+        return -1;
+    }
+
+    thread = &pipeline->threads[0];
+
+    for ( i = 1; i < pipeline->nthreads; i++ )
+    {
+        if ( pipeline->threads[i].npipes < thread->npipes )
+        {
+            thread = &pipeline->threads[i];
+        }
+    }
+
+    pipe->stream = stream;
+    pipe->loop = proxy->pipe_loop;
+    pipe->thread = thread;
+
+    pipe->loop_next = proxy->pipe_loop->head;
+    if ( pipe->loop_next )
+    {
+        pipe->loop_next->loop_prev = pipe;
+    }
+    proxy->pipe_loop->head = pipe;
+
+    /* From now on stream crypto state belongs to the thread */
+    stream->pipe = pipe;
+
+    pthread_mutex_lock ( &thread->lock );
+    pipe->thread_next = thread->head;
+    thread->head = pipe;
+    thread->npipes++;
+    pthread_cond_signal ( &thread->cond );
+    pthread_mutex_unlock ( &thread->lock );
+
+    verbose ( "socket:%i crypto moved to pipeline thread %i\n", stream->fd, thread->index );
+
+    return 0;
+}
+
+/**
+ * Release stream pipeline
+ */
+void pipe_release ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    struct pipe_t **iter;
+    struct pipe_t *pipe = stream->pipe;
+    struct pipe_thread_t *thread = pipe->thread;
+
+    /* Thread holds the lock while processing pipes */
+    pthread_mutex_lock ( &thread->lock );
+
+    for ( iter = &thread->head; *iter; iter = &( *iter )->thread_next )
+    {
+        if ( *iter == pipe )
+        {
+            *iter = pipe->thread_next;
+            break;
+        }
+    }
+
+    thread->npipes--;
+    pthread_mutex_unlock ( &thread->lock );
+
+    if ( pipe->loop_prev )
+    {
+        pipe->loop_prev->loop_next = pipe->loop_next;
+
+    } else
+    {
+        proxy->pipe_loop->head = pipe->loop_next;
+    }
+
+    if ( pipe->loop_next )
+    {
+        pipe->loop_next->loop_prev = pipe->loop_prev;
+    }
+
+    free ( pipe->input.buf );
+    free ( pipe->output.buf );
+    free ( pipe );
+    stream->pipe = NULL;
+}
+
+/**
+ * Move crypto of fast relations to worker threads
+ */
+void pipeline_check ( struct proxy_t *proxy )
+{
+    long msec;
+    unsigned long long rate;
+    struct timespec now;
+    struct stream_t *iter;
+    struct pipe_loop_t *loop = proxy->pipe_loop;
+
+    clock_gettime ( CLOCK_MONOTONIC, &now );
+
+    msec = ( now.tv_sec - loop->last_tick.tv_sec ) * 1000
+        + ( now.tv_nsec - loop->last_tick.tv_nsec ) / 1000000;
+
+    if ( msec < PIPELINE_INTERVAL_MSEC )
+    {
+        return;
+    }
+
+    loop->last_tick = now;
+
+    /* Each direction is moved on its own by its received byte rate */
+    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    {
+        if ( iter->role != S_PORT_A && iter->role != S_PORT_B )
+        {
+            continue;
+        }
+
+        rate = ( iter->nbytes_in - iter->nbytes_in_mark ) * 1000 / msec;
+        iter->nbytes_in_mark = iter->nbytes_in;
+
+        /* Held small reads are framed by this loop first */
+        if ( rate >= PIPELINE_MIN_RATE && !iter->pipe && iter->neighbour && !iter->abandoned
+            && iter->level == LEVEL_FORWARDING && !iter->sc.pending_len )
+        {
+            verbose ( "socket:%i receives %llu B/s\n", iter->fd, rate );
+
+            if ( pipe_create ( proxy, iter ) < 0 )
+            {
+                failure ( "cannot create pipeline for socket:%i\n", iter->fd );
+            }
+        }
+    }
+}
+
+/**
+ * Handle pipeline progress reported by worker threads
+ */
+int pipeline_events ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    uint64_t count;
+    struct pipe_t *pipe;
+    struct stream_t *neighbour;
+
+    if ( ~stream->revents & POLLIN )
+    {
+        return -1;
+    }
+
+    if ( read ( stream->fd, &count, sizeof ( count ) ) < 0 && errno != EAGAIN )
+    {
+        failure ( "cannot read pipeline event (%i)\n", errno );
+        return -1;
+    }
+
+    stream_would_block ( stream, POLLIN );
+
+    /* Cleared before scanning, so later progress wakes the loop again */
+    __atomic_store_n ( &proxy->pipe_loop->notified, 0, __ATOMIC_SEQ_CST );
+
+    for ( pipe = proxy->pipe_loop->head; pipe; pipe = pipe->loop_next )
+    {
+        stream = pipe->stream;
+        neighbour = stream->neighbour;
+
+        if ( __atomic_load_n ( &pipe->error, __ATOMIC_ACQUIRE ) )
+        {
+            failure ( "crypto data processing failed on socket:%i\n", stream->fd );
+            remove_relation ( stream );
+            schedule_stream ( proxy, stream );
+            continue;
+        }
+
+        if ( !stream->abandoned && !stream->eof && !spsc_ring_full ( &pipe->input ) )
+        {
+            stream->events |= POLLIN;
+
+            if ( stream->lrevents & POLLIN )
+            {
+                schedule_stream ( proxy, stream );
+            }
+        }
+
+        if ( neighbour && !neighbour->abandoned && pipe_has_output ( pipe ) )
+        {
+            neighbour->events |= POLLOUT;
+
+            if ( neighbour->lrevents & POLLOUT )
+            {
+                schedule_stream ( proxy, neighbour );
+            }
+        }
+    }
+
+    return 0;
+}
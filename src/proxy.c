@@ -2,7 +2,14 @@
  * SocksCrypt - Proxy Task Source Code
  * ------------------------------------------------------------------ */
 
-#include "sockscrypt.h"
+#define _GNU_SOURCE
+#include <netinet/tcp.h>
+
+#include "worker.h"
+#include "pipeline.h"
+#include "ktls.h"
+#include "coalesce.h"
+#include "timer.h"
 
 /**
  * Estabilish connection with endpoint
@@ -37,7 +44,6 @@ static int setup_endpoint_stream ( struct proxy_t *proxy, struct stream_t *strea
     if ( sc_new_stream ( &neighbour->sc, &proxy->sc_context, !proxy->client_side_mode ) < 0 )
     {
         remove_stream ( proxy, neighbour );
-        shutdown_then_close ( proxy, sock );
         return -1;
     }
 
@@ -50,27 +56,18 @@ static int setup_endpoint_stream ( struct proxy_t *proxy, struct stream_t *strea
     neighbour->neighbour = stream;
     stream->neighbour = neighbour;
 
+    /* Unanswered connect frees the relation */
+    timer_track ( proxy, neighbour );
+
     return 0;
 }
 
 /**
- * Handle new stream creation
+ * Start relation of an accepted stream
  */
-static int handle_new_stream ( struct proxy_t *proxy, struct stream_t *stream )
+static int setup_accepted_stream ( struct proxy_t *proxy, struct stream_t *util )
 {
     int status;
-    struct stream_t *util;
-
-    if ( ~stream->revents & POLLIN )
-    {
-        return -1;
-    }
-
-    /* Accept incoming connection */
-    if ( !( util = accept_new_stream ( proxy, stream->fd ) ) )
-    {
-        return -2;
-    }
 
     /* Setup stream crypto context */
     if ( sc_new_stream ( &util->sc, &proxy->sc_context, proxy->client_side_mode ) < 0 )
@@ -91,13 +88,157 @@ static int handle_new_stream ( struct proxy_t *proxy, struct stream_t *stream )
         return status;
     }
 
+    /* New relation starts as the most recently active one */
+    touch_stream ( proxy, util );
+
+    return 0;
+}
+
+/**
+ * Park accepted connection until stream slots are freed
+ */
+static int park_new_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int sock;
+
+    /* Further connections wait in the kernel accept queue */
+    if ( proxy->park_len == proxy->park_size )
+    {
+        verbose ( "park queue is full, accepting paused\n" );
+        stream->events &= ~POLLIN;
+        return 0;
+    }
+
+    if ( ( sock = accept4 ( stream->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) < 0 )
+    {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK )
+        {
+            stream_would_block ( stream, POLLIN );
+            return 0;
+        }
+
+        /* Client gave up while queued */
+        if ( errno == ECONNABORTED )
+        {
+            return 0;
+        }
+
+        failure ( "cannot accept incoming connection (%i) on socket:%i\n", errno, stream->fd );
+        return -2;
+    }
+
+    proxy->park[( proxy->park_head + proxy->park_len ) % proxy->park_size] = sock;
+    proxy->park_len++;
+
+    verbose ( "stream limit reached, parked socket:%i\n", sock );
+
+    /* Without a park queue the connection takes over the least active slot */
+    if ( !proxy->park_limit )
+    {
+        verbose ( "need to force cleanup...\n" );
+        force_cleanup ( proxy, NULL );
+    }
+
+    return 0;
+}
+
+/**
+ * Start relations of parked connections while stream slots are free
+ */
+static void unpark_streams ( struct proxy_t *proxy )
+{
+    int sock;
+    struct stream_t *util;
+    struct stream_t *listen = proxy->accept_stream;
+
+    while ( proxy->park_len && reserve_streams ( proxy, 2 ) >= 0 )
+    {
+        sock = proxy->park[proxy->park_head];
+        proxy->park_head = ( proxy->park_head + 1 ) % proxy->park_size;
+        proxy->park_len--;
+
+        verbose ( "unparked socket:%i\n", sock );
+
+        if ( !( util = insert_stream ( proxy, sock ) ) )
+        {
+            shutdown_then_close ( proxy, sock );
+            continue;
+        }
+
+        setup_accepted_stream ( proxy, util );
+    }
+
+    /* Resume accepting once the queue has room */
+    if ( proxy->park_len < proxy->park_size && ~listen->events & POLLIN )
+    {
+        listen->events |= POLLIN;
+
+        if ( listen->lrevents & POLLIN )
+        {
+            schedule_stream ( proxy, listen );
+        }
+    }
+}
+
+/**
+ * Handle new stream creation
+ */
+static int handle_new_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int count;
+    struct stream_t *util;
+
+    if ( ~stream->revents & POLLIN )
+    {
+        return -1;
+    }
+
+    /* Parked connections are served first */
+    if ( proxy->park_len )
+    {
+        unpark_streams ( proxy );
+    }
+
+    /* Drain connection bursts, the rest is left for the next cycle */
+    for ( count = 0; count < ACCEPT_BUDGET; count++ )
+    {
+        /* Both streams of the relation are allocated together */
+        if ( proxy->park_len || reserve_streams ( proxy, 2 ) < 0 )
+        {
+            return park_new_stream ( proxy, stream );
+        }
+
+        /* Accept incoming connection */
+        if ( !( util = accept_new_stream ( proxy, stream->fd ) ) )
+        {
+            /* Accept queue drained */
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                stream_would_block ( stream, POLLIN );
+                return 0;
+            }
+
+            /* Client gave up while queued */
+            if ( errno == ECONNABORTED )
+            {
+                continue;
+            }
+            return -2;
+        }
+
+        if ( setup_accepted_stream ( proxy, util ) == -2 )
+        {
+            return -2;
+        }
+    }
+
     return 0;
 }
 
 /**
  * Handle stream binding
  */
-static int handle_stream_binding ( struct stream_t *stream )
+static int handle_stream_binding ( struct proxy_t *proxy, struct stream_t *stream )
 {
     if ( stream->level == LEVEL_CONNECTING && stream->revents & ( POLLIN | POLLOUT ) )
     {
@@ -105,126 +246,556 @@ static int handle_stream_binding ( struct stream_t *stream )
         stream->events = POLLIN;
         stream->neighbour->level = LEVEL_FORWARDING;
         stream->neighbour->events = POLLIN;
-        return 0;
+        timer_keepalive ( proxy, stream->fd );
+        timer_keepalive ( proxy, stream->neighbour->fd );
+        timer_track ( proxy, stream );
+        return ktls_bind ( proxy, stream );
     }
 
     return -1;
 }
 
 /**
- * Handle stream data forward
+ * Check if the stream is about to produce more data to forward
  */
-static int sc_handle_forward_data ( struct proxy_t *proxy, struct stream_t *stream )
+static int forward_has_more ( const struct stream_t *source )
 {
-    int len = FORWARD_CHUNK_LEN;
-    int sendlim;
-    int sendwip;
-    socklen_t optlen;
-    uint8_t buffer[2 * AES256_BLOCKLEN + FORWARD_CHUNK_LEN];
+    return !source->abandoned && source->events & source->lrevents & POLLIN;
+}
 
-    if ( !stream->neighbour || stream->level != LEVEL_FORWARDING )
+/**
+ * Push out partial segment held back by MSG_MORE
+ */
+static void forward_push ( struct stream_t *stream )
+{
+    int one = 1;
+
+    stream->corked = 0;
+
+    /* Enabling no-delay flushes pending output, even if already enabled */
+    if ( setsockopt ( stream->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof ( one ) ) < 0 )
     {
+        failure ( "cannot push data to socket:%i (%i)\n", stream->fd, errno );
+    }
+}
+
+/**
+ * Check if data received from the stream still waits to be sent
+ */
+static int forward_pending ( struct stream_t *source )
+{
+    if ( source->ktls & KTLS_SPLICE )
+    {
+        return source->splice_len > 0;
+    }
+
+    if ( source->pipe )
+    {
+        return pipe_has_pending ( source->pipe );
+    }
+
+    return source->sc.pending_len || sc_has_output ( &source->sc );
+}
+
+/**
+ * Pass end of data on once everything received before it was sent
+ */
+static void forward_finish ( struct proxy_t *proxy, struct stream_t *source )
+{
+    struct stream_t *target = source->neighbour;
+
+    if ( !source->eof || target->shut || source->abandoned )
+    {
+        return;
+    }
+
+    /* Held small reads go out ahead of the end of data */
+    if ( !source->pipe && source->sc.pending_len && sc_flush_pending ( &source->sc ) < 0 )
+    {
+        remove_relation ( source );
+        return;
+    }
+
+    if ( forward_pending ( source ) )
+    {
+        if ( !source->pipe && sc_has_output ( &source->sc ) )
+        {
+            target->events |= POLLOUT;
+        }
+        return;
+    }
+
+    if ( shutdown ( target->fd, SHUT_WR ) < 0 )
+    {
+        failure ( "cannot shutdown socket:%i (%i)\n", target->fd, errno );
+        remove_relation ( source );
+        return;
+    }
+
+    target->shut = 1;
+
+    verbose ( "socket:%i has been half-closed\n", target->fd );
+
+    /* Relation is done once both directions ended */
+    if ( target->eof && source->shut )
+    {
+        remove_relation ( source );
+    }
+}
+
+/**
+ * Get data waiting to be sent to the stream
+ */
+static int forward_output ( struct stream_t *stream, struct iovec *iov )
+{
+    int len;
+    int wrapped;
+    uint8_t *buffer;
+    struct pipe_t *pipe = stream->neighbour->pipe;
+
+    /* Pipelined direction is processed by crypto thread */
+    if ( pipe )
+    {
+        /* Wrapped part first, data in front of it is complete by then */
+        iov[1].iov_base = pipe_output_wrapped ( pipe, &wrapped );
+        buffer = pipe_output_data ( pipe, &len );
+
+    } else
+    {
+        iov[1].iov_base = sc_output_wrapped ( &stream->neighbour->sc, &wrapped );
+        buffer = sc_output_data ( &stream->neighbour->sc, &len );
+    }
+
+    if ( !buffer )
+    {
+        return 0;
+    }
+
+    /* Frames wrapped around the ring go out in the same call */
+    iov[0].iov_base = buffer;
+    iov[0].iov_len = len;
+    iov[1].iov_len = wrapped;
+
+    return wrapped ? 2 : 1;
+}
+
+/**
+ * Release data sent to the stream
+ */
+static void forward_sent ( struct proxy_t *proxy, struct stream_t *stream, int len )
+{
+    struct pipe_t *pipe = stream->neighbour->pipe;
+
+    stream->nbytes += len;
+    proxy->nbytes += len;
+
+    if ( pipe )
+    {
+        pipe_output_consume ( pipe, len );
+
+    } else
+    {
+        sc_consume_data ( &stream->neighbour->sc, len );
+    }
+
+    verbose ( "bytes sent to socket:%i count %i\n", stream->fd, len );
+
+    /* Sent data made room for receiving more */
+    if ( !stream->neighbour->eof )
+    {
+        stream->neighbour->events |= POLLIN;
+    }
+
+    if ( pipe ? !pipe_has_output ( pipe ) : !sc_has_output ( &stream->neighbour->sc ) )
+    {
+        stream->events &= ~POLLOUT;
+        forward_finish ( proxy, stream->neighbour );
+    }
+}
+
+/**
+ * Pass data received from the stream on to crypto
+ */
+static int forward_received ( struct proxy_t *proxy, struct stream_t *stream, int len )
+{
+    stream->nbytes += len;
+    stream->nbytes_in += len;
+    proxy->nbytes += len;
+
+    /* Output is announced by crypto thread */
+    if ( stream->pipe )
+    {
+        pipe_input_commit ( stream->pipe, len );
+        return 0;
+    }
+
+    /* Frames of streams ready in the same cycle are encrypted together */
+    if ( sc_process_batched ( &stream->sc, len ) < 0 )
+    {
+        failure ( "crypto data processing failed between socket:%i and socket:%i\n",
+            stream->fd, stream->neighbour->fd );
         return -1;
     }
 
-    if ( stream->revents & POLLOUT )
+    /* Held small reads are framed by the timer */
+    coalesce_track ( proxy, stream );
+
+    return 0;
+}
+
+/**
+ * Note end of data, data still in the ring is sent before the end is passed on
+ */
+static void forward_eof ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    verbose ( "socket:%i reached end of data\n", stream->fd );
+    stream->eof = 1;
+    stream->events &= ~POLLIN;
+    stream_would_block ( stream, POLLIN );
+}
+
+/**
+ * Get ring room for data received from the stream
+ */
+static uint8_t *forward_input ( struct proxy_t *proxy, struct stream_t *stream, int *len )
+{
+    uint8_t *buffer;
+
+    /* Data is received straight into the crypto ring */
+    if ( !( buffer =
+            stream->pipe ? pipe_input_buffer ( stream->pipe, len ) : sc_input_buffer ( &stream->sc,
+                len ) ) )
+    {
+        verbose ( "ring buffer of socket:%i is full\n", stream->fd );
+        stream->events &= ~POLLIN;
+        return NULL;
+    }
+
+    if ( *len > proxy->sc_context.chunk_len )
+    {
+        *len = proxy->sc_context.chunk_len;
+    }
+
+    return buffer;
+}
+
+/**
+ * Send to the stream
+ */
+static int forward_send ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int len;
+    int want;
+    int iovcnt;
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    if ( !( iovcnt = forward_output ( stream, iov ) ) )
     {
-        if ( !stream->neighbour->sc.processed_len )
+        stream->events &= ~POLLOUT;
+        forward_finish ( proxy, stream->neighbour );
+        return 0;
+    }
+
+    memset ( &msg, '\0', sizeof ( msg ) );
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    /* Socket is non-blocking, kernel takes as much as it can */
+    want = iov[0].iov_len + iov[1].iov_len;
+    stream->corked = forward_has_more ( stream->neighbour );
+    len = sendmsg ( stream->fd, &msg, MSG_NOSIGNAL | ( stream->corked ? MSG_MORE : 0 ) );
+    stream->nsyscalls++;
+
+    if ( len < 0 )
+    {
+        if ( errno == EAGAIN || errno == EWOULDBLOCK )
         {
-            stream->events &= ~POLLOUT;
-            stream->neighbour->events |= POLLIN;
+            stream_would_block ( stream, POLLOUT );
             return 0;
         }
 
-        if ( ioctl ( stream->fd, TIOCOUTQ, &sendwip ) < 0 )
+        failure ( "cannot send data to socket:%i\n", stream->fd );
+        return -1;
+    }
+
+    /* Short write means send buffer is full */
+    if ( len < want )
+    {
+        stream_would_block ( stream, POLLOUT );
+    }
+
+    forward_sent ( proxy, stream, len );
+
+    return 0;
+}
+
+/**
+ * Send to the stream with io_uring, one request in flight at a time
+ */
+static int forward_send_uring ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int iovcnt;
+    struct iovec iov[2];
+
+    /* Completion of the request in flight stands for readiness */
+    if ( stream->uring_ops & URING_OP_SEND || ~stream->lrevents & POLLOUT )
+    {
+        stream_would_block ( stream, POLLOUT );
+        return 0;
+    }
+
+    if ( !( iovcnt = forward_output ( stream, iov ) ) )
+    {
+        stream->events &= ~POLLOUT;
+        forward_finish ( proxy, stream->neighbour );
+        return 0;
+    }
+
+    stream_would_block ( stream, POLLOUT );
+
+    /* Cork could be released before the request runs, so none is set */
+    return stream_queue_send ( proxy, stream, iov, iovcnt, MSG_NOSIGNAL );
+}
+
+/**
+ * Receive from the stream until it runs dry
+ */
+static int forward_receive ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int len;
+    int want;
+    int budget;
+    uint8_t *buffer;
+
+    /* Drain the socket, the budget lets other streams have their turn */
+    for ( budget = FORWARD_READ_BUDGET; budget > 0; budget -= len )
+    {
+        if ( !( buffer = forward_input ( proxy, stream, &len ) ) )
         {
-            failure ( "cannot get socket:%i pending bytes count (%i)\n", stream->neighbour->fd,
-                errno );
-            return -1;
+            break;
         }
 
-        optlen = sizeof ( sendlim );
+        want = len;
+        len = recv ( stream->fd, buffer, want, 0 );
+        stream->nsyscalls++;
 
-        if ( getsockopt ( stream->fd, SOL_SOCKET, SO_SNDBUF, &sendlim, &optlen ) < 0 )
+        if ( len < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
         {
-            failure ( "cannot get socket:%i output capacity (%i)\n", stream->neighbour->fd, errno );
-            return -1;
+            stream_would_block ( stream, POLLIN );
+            break;
         }
 
-        if ( optlen != sizeof ( sendlim ) )
+        if ( !len )
         {
-            failure ( "socket:%i output capacity data type is invalid\n", stream->neighbour->fd );
-            return -1;
+            forward_eof ( proxy, stream );
+            break;
         }
 
-        if ( sendwip > sendlim )
+        if ( len < 0 )
         {
-            failure ( "socket:%i capacity is less than data pending\n", stream->neighbour->fd );
+            failure ( "cannot receive data (%i) from socket:%i\n", errno, stream->fd );
             return -1;
         }
 
-        sendlim -= sendwip;
+        /* Short read means receive queue is drained, unless end of stream waits behind */
+        if ( len < want && ~stream->lrevents & POLLRDHUP )
+        {
+            stream_would_block ( stream, POLLIN );
+        }
 
-        if ( !sendlim )
+        if ( forward_received ( proxy, stream, len ) < 0 )
         {
-            failure ( "socket:%i was expected to be write ready\n", stream->neighbour->fd );
             return -1;
         }
 
-        if ( sendlim < len )
+        if ( ~stream->lrevents & POLLIN )
         {
-            len = sendlim;
-            verbose ( "bytes count limited to socket:%i output capacity: %i\n",
-                stream->neighbour->fd, len );
+            break;
         }
+    }
+
+    return 0;
+}
+
+/**
+ * Receive from the stream with io_uring, straight into the crypto ring
+ */
+static int forward_receive_uring ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int len;
+    uint8_t *buffer;
+
+    if ( stream->uring_ops & URING_OP_RECV || ~stream->lrevents & POLLIN )
+    {
+        stream_would_block ( stream, POLLIN );
+        return 0;
+    }
 
-        if ( stream->neighbour->sc.processed_len < len )
+    /* Timer writes held small reads into the ring, so they are received the plain way */
+    if ( !stream->pipe && stream->sc.pending_len )
+    {
+        return forward_receive ( proxy, stream );
+    }
+
+    if ( !( buffer = forward_input ( proxy, stream, &len ) ) )
+    {
+        return 0;
+    }
+
+    stream_would_block ( stream, POLLIN );
+
+    return stream_queue_recv ( proxy, stream, buffer, len );
+}
+
+/**
+ * Account requests finished on io_uring, also those handed over by another worker
+ */
+static int forward_completed ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int len;
+    int room;
+    uint8_t *buffer;
+
+    if ( stream->uring_done & URING_OP_SEND )
+    {
+        stream->uring_done &= ~URING_OP_SEND;
+
+        /* Kernel did not wait for room, poll reports it */
+        if ( ( len = stream->uring_send_res ) == -EAGAIN )
+        {
+            stream_would_block ( stream, POLLOUT );
+
+        } else if ( len < 0 )
         {
-            len = stream->neighbour->sc.processed_len;
-            verbose ( "bytes count limited to socket:%i processed data length: %i\n",
-                stream->neighbour->fd, len );
+            failure ( "cannot send data (%i) to socket:%i\n", -len, stream->fd );
+            return -1;
+
+        } else
+        {
+            forward_sent ( proxy, stream, len );
         }
+    }
+
+    if ( ~stream->uring_done & URING_OP_RECV || stream->abandoned )
+    {
+        return 0;
+    }
 
-        if ( ( len = send ( stream->fd, stream->neighbour->sc.processed, len, MSG_NOSIGNAL ) ) < 0 )
+    stream->uring_done &= ~URING_OP_RECV;
+
+    /* Kernel did not wait for data, poll reports it */
+    if ( ( len = stream->uring_recv_res ) == -EAGAIN )
+    {
+        stream_would_block ( stream, POLLIN );
+        return 0;
+    }
+
+    if ( !len )
+    {
+        forward_eof ( proxy, stream );
+        return 0;
+    }
+
+    if ( len < 0 )
+    {
+        failure ( "cannot receive data (%i) from socket:%i\n", -len, stream->fd );
+        return -1;
+    }
+
+    /* Ring may offer its start instead once sent data was released meanwhile */
+    buffer = stream->pipe ? pipe_input_buffer ( stream->pipe, &room )
+        : sc_input_buffer ( &stream->sc, &room );
+
+    if ( buffer != stream->uring_recv_buf )
+    {
+        if ( !buffer || room < len )
         {
-            failure ( "cannot send data to socket:%i\n", stream->neighbour->fd );
+            failure ( "ring buffer of socket:%i lost received data\n", stream->fd );
             return -1;
         }
 
-        stream->neighbour->sc.processed_len -= len;
+        memmove ( buffer, stream->uring_recv_buf, len );
+    }
 
-        verbose ( "bytes sent to socket:%i count %i left %i\n", stream->neighbour->fd, len,
-            stream->neighbour->sc.processed_len );
+    return forward_received ( proxy, stream, len );
+}
 
-        if ( stream->neighbour->sc.processed_len )
+/**
+ * Handle stream data forward
+ */
+static int sc_handle_forward_data ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( !stream->neighbour || stream->level != LEVEL_FORWARDING )
+    {
+        return -1;
+    }
+
+    if ( stream->uring_done && forward_completed ( proxy, stream ) < 0 )
+    {
+        return -1;
+    }
+
+    if ( stream->abandoned )
+    {
+        return 0;
+    }
+
+    /* Kernel TLS data never reaches userspace */
+    if ( stream->revents & POLLOUT && stream->neighbour->ktls & KTLS_SPLICE )
+    {
+        if ( ktls_splice_out ( proxy, stream ) < 0 )
         {
-            memcpy ( buffer, stream->neighbour->sc.processed + len,
-                stream->neighbour->sc.processed_len );
-            memcpy ( stream->neighbour->sc.processed, buffer, stream->neighbour->sc.processed_len );
+            return -1;
+        }
 
-        } else
+        forward_finish ( proxy, stream->neighbour );
+
+    } else if ( stream->revents & POLLOUT )
+    {
+        if ( ( proxy->uring ? forward_send_uring ( proxy, stream ) : forward_send ( proxy,
+                    stream ) ) < 0 )
         {
-            stream->events &= ~POLLOUT;
-            stream->neighbour->events |= POLLIN;
+            return -1;
         }
+    }
+
+    if ( stream->abandoned )
+    {
+        return 0;
+    }
 
-    } else if ( stream->revents & POLLIN )
+    if ( stream->revents & POLLIN && stream->ktls )
     {
-        if ( ( len = recv ( stream->fd, buffer, FORWARD_CHUNK_LEN, 0 ) ) <= 0 )
+        if ( ktls_receive ( proxy, stream ) < 0 )
         {
-            failure ( "cannot receive data (%i) from socket:%i\n", errno, stream->fd );
             return -1;
         }
 
-        if ( sc_process_data ( &stream->sc, buffer, len ) < 0 )
+        forward_finish ( proxy, stream );
+        return 0;
+    }
+
+    if ( stream->revents & POLLIN )
+    {
+        if ( ( proxy->uring ? forward_receive_uring ( proxy, stream ) : forward_receive ( proxy,
+                    stream ) ) < 0 )
         {
-            failure ( "crypto data processing failed between socket:%i and socket:%i\n", stream->fd,
-                stream->neighbour->fd );
             return -1;
         }
 
-        stream->events &= ~POLLIN;
-        stream->neighbour->events |= POLLOUT;
+        /* Keep receiving while earlier data is being sent */
+        if ( !stream->pipe && sc_has_output ( &stream->sc ) )
+        {
+            stream->neighbour->events |= POLLOUT;
+
+        } else if ( stream->neighbour->corked && !forward_has_more ( stream ) )
+        {
+            /* Nothing left to send, so nothing else releases the cork */
+            forward_push ( stream->neighbour );
+        }
+
+        forward_finish ( proxy, stream );
     }
 
     return 0;
@@ -236,9 +807,15 @@ static int sc_handle_forward_data ( struct proxy_t *proxy, struct stream_t *stre
 int handle_stream_events ( struct proxy_t *proxy, struct stream_t *stream )
 {
     int status;
+    unsigned long long nbytes = stream->nbytes;
 
     if ( sc_handle_forward_data ( proxy, stream ) >= 0 )
     {
+        /* Relations moving data are evicted last */
+        if ( stream->nbytes != nbytes )
+        {
+            touch_stream ( proxy, stream );
+        }
         return 0;
     }
 
@@ -251,8 +828,32 @@ int handle_stream_events ( struct proxy_t *proxy, struct stream_t *stream )
             return -1;
         }
         return 0;
+    case L_HANDOFF:
+        if ( worker_adopt ( proxy, stream ) < 0 )
+        {
+            return -1;
+        }
+        return 0;
+    case L_PIPELINE:
+        if ( pipeline_events ( proxy, stream ) < 0 )
+        {
+            return -1;
+        }
+        return 0;
+    case L_COALESCE:
+        if ( coalesce_events ( proxy, stream ) < 0 )
+        {
+            return -1;
+        }
+        return 0;
+    case L_TIMER:
+        if ( timer_events ( proxy, stream ) < 0 )
+        {
+            return -1;
+        }
+        return 0;
     case S_PORT_B:
-        if ( ( status = handle_stream_binding ( stream ) ) >= 0 )
+        if ( ( status = handle_stream_binding ( proxy, stream ) ) >= 0 )
         {
             return 0;
         }
@@ -264,6 +865,38 @@ int handle_stream_events ( struct proxy_t *proxy, struct stream_t *stream )
     return 0;
 }
 
+/**
+ * Release stream resources
+ */
+void handle_stream_release ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( stream->nbytes )
+    {
+        verbose ( "socket:%i relayed %llu bytes with %lu syscalls (%llu per MB)\n", stream->fd,
+            stream->nbytes, stream->nsyscalls,
+            ( unsigned long long ) stream->nsyscalls * 1048576 / stream->nbytes );
+    }
+
+    if ( stream->sc.plain_bytes )
+    {
+        verbose ( "socket:%i sent %llu bytes as %llu wire bytes (%llu%% overhead)\n", stream->fd,
+            stream->sc.plain_bytes, stream->sc.wire_bytes,
+            ( stream->sc.wire_bytes - stream->sc.plain_bytes ) * 100 / stream->sc.plain_bytes );
+    }
+
+    coalesce_release ( proxy, stream );
+    timer_release ( stream );
+
+    /* Crypto thread must let go of the stream first */
+    if ( stream->pipe )
+    {
+        pipe_release ( proxy, stream );
+    }
+
+    ktls_release ( stream );
+    sc_free_stream ( &stream->sc );
+}
+
 /**
  * Proxy task entry point
  */
@@ -279,7 +912,31 @@ int proxy_task ( struct proxy_t *proxy )
     /* Reset current state */
     proxy->stream_head = NULL;
     proxy->stream_tail = NULL;
-    memset ( proxy->stream_pool, '\0', sizeof ( proxy->stream_pool ) );
+    proxy->ready_head = NULL;
+    proxy->ready_tail = NULL;
+    proxy->ready_len = 0;
+    proxy->lru_head = NULL;
+    proxy->lru_tail = NULL;
+    proxy->park = NULL;
+    proxy->park_head = 0;
+    proxy->park_len = 0;
+    proxy->stream_free = NULL;
+    proxy->stream_chunks = NULL;
+    proxy->stream_count = 0;
+    proxy->stream_capacity = 0;
+    proxy->poll_list = NULL;
+    proxy->poll_size = 0;
+    proxy->pipe_loop = NULL;
+    proxy->coalesce_timer = NULL;
+    proxy->coalesce_head = NULL;
+    proxy->coalesce_tail = NULL;
+    proxy->coalesce_armed = 0;
+    proxy->wheel = NULL;
+
+    if ( !proxy->stream_limit )
+    {
+        proxy->stream_limit = 2 * RELATION_LIMIT + 1;
+    }
 
     /* Proxy events setup */
     if ( proxy_events_setup ( proxy ) < 0 )
@@ -287,13 +944,12 @@ int proxy_task ( struct proxy_t *proxy )
         return -1;
     }
 
-    /* Setup listen socket */
-    if ( ( sock = listen_socket ( proxy, &proxy->entrance ) ) < 0 )
+    sock = proxy->listen_sock;
+
+    /* Setup listen socket unless already bound */
+    if ( sock < 0 && ( sock = listen_socket ( proxy, &proxy->entrance ) ) < 0 )
     {
-        if ( proxy->epoll_fd >= 0 )
-        {
-            close ( proxy->epoll_fd );
-        }
+        proxy_events_close ( proxy );
         return -1;
     }
 
@@ -301,34 +957,117 @@ int proxy_task ( struct proxy_t *proxy )
     if ( !( stream = insert_stream ( proxy, sock ) ) )
     {
         shutdown_then_close ( proxy, sock );
-        if ( proxy->epoll_fd >= 0 )
-        {
-            close ( proxy->epoll_fd );
-        }
+        free_streams ( proxy );
+        proxy_events_close ( proxy );
         return -1;
     }
 
     /* Update listen stream */
     stream->role = L_ACCEPT;
     stream->events = POLLIN;
+    proxy->accept_stream = stream;
+
+    /* Accepts beyond the stream limit wait here, one at a time when evicting */
+    proxy->park_size = proxy->park_limit ? proxy->park_limit : 1;
+
+    if ( !( proxy->park = calloc ( proxy->park_size, sizeof ( int ) ) ) )
+    {
+        stream->fd = -1;
+        remove_all_streams ( proxy );
+        free_streams ( proxy );
+        proxy_events_close ( proxy );
+        return -1;
+    }
+
+    /* Join worker hand-off queue, crypto pipeline and timeouts */
+    if ( timer_attach ( proxy ) < 0 || ( proxy->worker && worker_attach ( proxy ) < 0 )
+        || ( proxy->pipeline && pipeline_attach ( proxy ) < 0 )
+        || ( proxy->sc_context.coalesce_usec && coalesce_attach ( proxy ) < 0 ) )
+    {
+        stream->fd = -1;
+        if ( proxy->worker )
+        {
+            worker_detach ( proxy );
+        }
+        remove_all_streams ( proxy );
+        pipeline_detach ( proxy );
+        timer_detach ( proxy );
+        free_streams ( proxy );
+        free ( proxy->park );
+        proxy_events_close ( proxy );
+        return -1;
+    }
+
+    /* Service streams do not take slots of relations */
+    proxy->stream_limit += proxy->stream_count - 1;
 
     verbose ( "proxy setup was successful\n" );
 
     /* Run forward loop */
-    while ( ( status = handle_streams_cycle ( proxy ) ) >= 0 );
+    while ( ( status = handle_streams_cycle ( proxy ) ) >= 0 )
+    {
+        /* Leftover frames are encrypted before streams move elsewhere */
+        sc_batch_flush ( &proxy->sc_context );
+
+        /* Slots freed in this cycle go to parked connections */
+        if ( proxy->park_len )
+        {
+            unpark_streams ( proxy );
+        }
+
+        /* Top up nonce pool between event waits */
+        if ( ( status = sc_refill_nonces ( &proxy->sc_context ) ) < 0 )
+        {
+            failure ( "nonce pool refill failed\n" );
+            break;
+        }
+
+        if ( status > 0 )
+        {
+            verbose ( "nonce pool refilled, hits: %lu misses: %lu refills: %lu\n",
+                proxy->sc_context.nonce_pool.hits, proxy->sc_context.nonce_pool.misses,
+                proxy->sc_context.nonce_pool.refills );
+        }
+
+        /* Move crypto of fast relations off the event loop */
+        if ( proxy->pipe_loop )
+        {
+            pipeline_check ( proxy );
+        }
+
+        /* Shed load to idle workers */
+        if ( proxy->worker )
+        {
+            worker_rebalance ( proxy );
+        }
+    }
 
     /* Do not close reset pipe */
     stream->fd = -1;
 
+    /* Hand-off queue outlives the worker loop */
+    if ( proxy->worker )
+    {
+        worker_detach ( proxy );
+    }
+
     /* Remove all streams */
     remove_all_streams ( proxy );
+    pipeline_detach ( proxy );
+    timer_detach ( proxy );
+    free_streams ( proxy );
 
-    /* Close epoll fd if created */
-    if ( proxy->epoll_fd >= 0 )
+    /* Parked connections were never started */
+    while ( proxy->park_len )
     {
-        close ( proxy->epoll_fd );
-        proxy->epoll_fd = -1;
+        shutdown_then_close ( proxy, proxy->park[proxy->park_head] );
+        proxy->park_head = ( proxy->park_head + 1 ) % proxy->park_size;
+        proxy->park_len--;
     }
+    free ( proxy->park );
+
+    /* Close epoll fd or io_uring if created */
+    proxy_events_close ( proxy );
 
     verbose ( "done proxy uninitializing\n" );
 
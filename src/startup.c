@@ -2,7 +2,8 @@
  * SocksCrypt - Main Program File
  * ------------------------------------------------------------------ */
 
-#include "sockscrypt.h"
+#include "worker.h"
+#include "pipeline.h"
 
 /**
  * Show program usage message
@@ -10,14 +11,83 @@
 static void show_usage ( void )
 {
     failure
-        ( "usage: sockscrypt [-vdcs] aeskey-file listen-addr:listen-port endp-addr:endp-port\n\n"
+        ( "usage: sockscrypt [-vdcspbut] [options] aeskey-file listen-addr:listen-port endp-addr:endp-port\n\n"
         "       option -v         Enable verbose logging\n"
         "       option -d         Run in background\n" "       option -c         Client-side mode\n"
         "       option -s         Server-side mode\n"
+        "       option -p         Pin worker threads to cores\n"
+        "       option -b         Rebalance relations between workers\n"
+        "       option -u         Use io_uring event backend if supported\n"
+        "       option -t         Offload sent data to kernel TLS if supported\n"
+        "       option -r kbytes  Ring buffer size per direction (default: %i)\n"
+        "       option -n count   Maximum concurrent relations (default: %i)\n"
+        "       option -q count   Park accepts over the limit instead of evicting (default: 0, off)\n"
+        "       option -m count   Listen backlog for connection bursts (default: %i)\n"
+        "       option -l kbytes  Receive chunk size, above 64 sent as jumbo frames (default: %i)\n"
+        "       option -w usec    Window for merging small reads into one frame (default: 0, off)\n"
+        "       option -g bytes   Reads below this size are merged (default: %i)\n"
+        "       option -o sec     Connect timeout, 0 to wait forever (default: %i)\n"
+        "       option -i sec     Idle relation timeout, 0 to keep forever (default: 0)\n"
+        "       option -x sec     Drop unresponsive peers, 0 for system default (default: %i)\n"
+        "       option -j count   Worker threads sharing the listen port (default: 1)\n"
+        "       option -k count   Crypto threads for fast relations (default: 0)\n"
+        "       option -e engine  AES engine to use (default: fastest)\n"
+        "       option -a cipher  Wire cipher for sent data: cbc, gcm, chacha20 or aead (default: cbc)\n"
         "       aeskey-file       Plain AES-256 key file\n"
         "       listen-addr       Gateway address\n" "       listen-port       Gateway port\n"
         "       endp-addr         Endpoint address\n"
-        "       endp-port         Endpoint port\n\n" "Note: Both IPv4 and IPv6 can be used\n\n" );
+        "       endp-port         Endpoint port\n\n" "Note: Both IPv4 and IPv6 can be used\n\n",
+        RING_BUFFER_SIZE / 1024, RELATION_LIMIT, LISTEN_BACKLOG, FORWARD_CHUNK_LEN / 1024,
+        COALESCE_BYTES,
+        CONNECT_TIMEOUT_SEC, PEER_TIMEOUT_SEC );
+}
+
+/**
+ * Parse numeric option value
+ */
+static int parse_option_value ( const char *input, long min, long max, long *value )
+{
+    char *end;
+
+    errno = 0;
+    *value = strtol ( input, &end, 10 );
+
+    if ( errno || end == input || *end || *value < min || *value > max )
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Pick fastest AES engine producing compatible output
+ */
+static const struct sc_engine_t *select_fastest_engine ( struct sc_context_t *context )
+{
+    size_t i;
+    unsigned long rate;
+    unsigned long best_rate = 0;
+    const struct sc_engine_t *engine;
+    const struct sc_engine_t *best = context->engine;
+
+    for ( i = 0; ( engine = sc_engine_at ( i ) ); i++ )
+    {
+        if ( sc_engine_benchmark ( context, engine, &rate ) < 0 )
+        {
+            continue;
+        }
+
+        info ( "aes engine %s runs at %lu MB/s\n", engine->name, rate / 1048576 );
+
+        if ( rate > best_rate )
+        {
+            best_rate = rate;
+            best = engine;
+        }
+    }
+
+    return best;
 }
 
 /**
@@ -26,18 +96,38 @@ static void show_usage ( void )
 int main ( int argc, char *argv[] )
 {
     int fd;
+    int arg;
     int daemon_flag = 0;
+    long ring_kbytes = RING_BUFFER_SIZE / 1024;
+    long chunk_kbytes = FORWARD_CHUNK_LEN / 1024;
+    long coalesce_usec = 0;
+    long coalesce_bytes = COALESCE_BYTES;
+    long connect_timeout = CONNECT_TIMEOUT_SEC;
+    long idle_timeout = 0;
+    long peer_timeout = PEER_TIMEOUT_SEC;
+    long relations = RELATION_LIMIT;
+    long park_limit = 0;
+    long backlog = LISTEN_BACKLOG;
+    long nworkers = 1;
+    long npipes = 0;
+    int pin_flag = 0;
+    int balance_flag = 0;
+    int aead = SC_AEAD_NONE;
+    int status;
     size_t len;
+    const struct sc_engine_t *engine = NULL;
     struct proxy_t proxy = { 0 };
     uint8_t key[AES256_KEYLEN];
 
     setbuf ( stdout, NULL );
 
+    proxy.listen_sock = -1;
+
     /* Show program version */
     info ( "SocksCrypt - ver. " SOCKSCRYPT_VERSION "\n" );
 
     /* Validate arguments count */
-    if ( argc != 5 )
+    if ( argc < 5 || argc % 2 == 0 )
     {
         show_usage (  );
         return 1;
@@ -66,20 +156,155 @@ int main ( int argc, char *argv[] )
 
     proxy.verbose = !!strchr ( argv[1], 'v' );
     daemon_flag = !!strchr ( argv[1], 'd' );
+    pin_flag = !!strchr ( argv[1], 'p' );
+    balance_flag = !!strchr ( argv[1], 'b' );
+    proxy.use_uring = !!strchr ( argv[1], 'u' );
+    proxy.use_ktls = !!strchr ( argv[1], 't' );
 
-    if ( ip_port_decode ( argv[3], &proxy.entrance ) < 0 )
+    /* Parse options with values */
+    for ( arg = 2; arg < argc - 3; arg += 2 )
+    {
+        if ( !strcmp ( argv[arg], "-r" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 4, 65536, &ring_kbytes ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-l" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 1, SC_FRAME_MAX / 1024,
+                    &chunk_kbytes ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-w" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 0, 1000000, &coalesce_usec ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-g" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 16, 16384, &coalesce_bytes ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-o" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 0, 86400, &connect_timeout ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-i" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 0, 86400, &idle_timeout ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-x" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 0, 86400, &peer_timeout ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-n" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 1, 1048576, &relations ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-q" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 0, 65536, &park_limit ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-m" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 1, 65535, &backlog ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-j" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 1, WORKERS_MAX, &nworkers ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-e" ) )
+        {
+            if ( !( engine = sc_engine_find ( argv[arg + 1] ) ) )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-a" ) )
+        {
+            if ( ( aead = sc_aead_find ( argv[arg + 1] ) ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else if ( !strcmp ( argv[arg], "-k" ) )
+        {
+            if ( parse_option_value ( argv[arg + 1], 0, PIPELINE_THREADS_MAX, &npipes ) < 0 )
+            {
+                show_usage (  );
+                return 1;
+            }
+
+        } else
+        {
+            show_usage (  );
+            return 1;
+        }
+    }
+
+    /* Whole chunk must fit the ring next to data still queued */
+    if ( chunk_kbytes > ring_kbytes / 2 )
+    {
+        failure ( "receive chunk of %li KB needs ring of at least %li KB\n", chunk_kbytes,
+            2 * chunk_kbytes );
+        return 1;
+    }
+
+    if ( ip_port_decode ( argv[arg + 1], &proxy.entrance ) < 0 )
     {
         show_usage (  );
         return 1;
     }
 
-    if ( ip_port_decode ( argv[4], &proxy.endpoint ) < 0 )
+    if ( ip_port_decode ( argv[arg + 2], &proxy.endpoint ) < 0 )
     {
         show_usage (  );
         return 1;
     }
 
-    if ( ( fd = open ( argv[2], O_RDONLY ) ) < 0 )
+    if ( ( fd = open ( argv[arg], O_RDONLY ) ) < 0 )
     {
         failure ( "unable to open aes key file: %i\n", errno );
         return 1;
@@ -110,7 +335,37 @@ int main ( int argc, char *argv[] )
 
     memset ( key, '\0', sizeof ( key ) );
 
+    proxy.sc_context.ring_size = ring_kbytes * 1024;
+    proxy.sc_context.chunk_len = chunk_kbytes * 1024;
+    proxy.sc_context.coalesce_usec = coalesce_usec;
+    proxy.sc_context.coalesce_bytes = coalesce_bytes;
+    proxy.sc_context.aead = aead;
+
+    proxy.connect_timeout = connect_timeout;
+    proxy.idle_timeout = idle_timeout;
+    proxy.peer_timeout = peer_timeout;
+
+    /* Each relation takes a stream pair, plus the listen stream */
+    proxy.stream_limit = 2 * relations + 1;
+    proxy.park_limit = park_limit;
+    proxy.listen_backlog = backlog;
+
     info ( "loaded password from file\n" );
+    /* Benchmark engines unless one is forced */
+    if ( !engine )
+    {
+        engine = select_fastest_engine ( &proxy.sc_context );
+    }
+
+    if ( sc_engine_select ( &proxy.sc_context, engine ) < 0 )
+    {
+        failure ( "aes engine %s is not supported\n", engine->name );
+        sc_free ( &proxy.sc_context );
+        return 1;
+    }
+
+    info ( "using %s aes engine\n", sc_engine_name ( &proxy.sc_context ) );
+    info ( "sending with %s\n", sc_aead_name ( aead ) );
 
     /* Run in background if needed */
     if ( daemon_flag )
@@ -122,8 +377,46 @@ int main ( int argc, char *argv[] )
         }
     }
 
+    /* Crypto threads are shared by all workers */
+    if ( npipes && !( proxy.pipeline = pipeline_start ( npipes ) ) )
+    {
+        failure ( "cannot start crypto threads (%i)\n", errno );
+        sc_free ( &proxy.sc_context );
+        return 1;
+    }
+
+    /* Launch worker threads if requested */
+    if ( nworkers > 1 || pin_flag )
+    {
+        if ( proxy_workers ( &proxy, nworkers, pin_flag, balance_flag ) < 0 )
+        {
+            failure ( "exit status: %i\n", errno );
+            if ( proxy.pipeline )
+            {
+                pipeline_stop ( proxy.pipeline );
+            }
+            sc_free ( &proxy.sc_context );
+            return 1;
+        }
+
+        if ( proxy.pipeline )
+        {
+            pipeline_stop ( proxy.pipeline );
+        }
+        sc_free ( &proxy.sc_context );
+        info ( "exit status: success\n" );
+        return 0;
+    }
+
     /* Launch the proxy task */
-    if ( proxy_task ( &proxy ) < 0 )
+    status = proxy_task ( &proxy );
+
+    if ( proxy.pipeline )
+    {
+        pipeline_stop ( proxy.pipeline );
+    }
+
+    if ( status < 0 )
     {
         failure ( "exit status: %i\n", errno );
         return 1;
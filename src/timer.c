@@ -0,0 +1,404 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Timer Wheel Source Code
+ * ------------------------------------------------------------------ */
+
+#include <stddef.h>
+#include <netinet/tcp.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+
+/**
+ * Get current wheel tick
+ */
+static uint64_t wheel_now ( const struct wheel_t *wheel )
+{
+    return ( sc_clock_usec (  ) / 1000 - wheel->origin_msec ) / TIMER_TICK_MSEC;
+}
+
+/**
+ * Get wheel level of the timer
+ */
+static int wheel_level ( const struct wheel_t *wheel, uint64_t expires )
+{
+    int level;
+    uint64_t delta = expires - wheel->tick;
+
+    for ( level = 0; level < WHEEL_LEVELS - 1; level++ )
+    {
+        if ( delta < ( uint64_t ) 1 << ( WHEEL_BITS * ( level + 1 ) ) )
+        {
+            break;
+        }
+    }
+
+    return level;
+}
+
+/**
+ * Put timer into its wheel slot
+ */
+static void wheel_insert ( struct wheel_t *wheel, struct wheel_timer_t *timer )
+{
+    int level = wheel_level ( wheel, timer->expires );
+    struct wheel_timer_t **slot =
+        &wheel->slots[level][( timer->expires >> ( WHEEL_BITS * level ) ) & WHEEL_MASK];
+
+    timer->next = *slot;
+    timer->pprev = slot;
+
+    if ( *slot )
+    {
+        ( *slot )->pprev = &timer->next;
+    }
+
+    *slot = timer;
+}
+
+/**
+ * Take timer out of its wheel slot
+ */
+static void wheel_remove ( struct wheel_t *wheel, struct wheel_timer_t *timer )
+{
+    *timer->pprev = timer->next;
+
+    if ( timer->next )
+    {
+        timer->next->pprev = timer->pprev;
+    }
+
+    timer->next = NULL;
+    timer->pprev = NULL;
+    wheel->count--;
+}
+
+/**
+ * Move timers of a higher level slot down the wheel
+ */
+static void wheel_cascade ( struct wheel_t *wheel, int level )
+{
+    struct wheel_timer_t *timer;
+    struct wheel_timer_t *next;
+    struct wheel_timer_t **slot =
+        &wheel->slots[level][( wheel->tick >> ( WHEEL_BITS * level ) ) & WHEEL_MASK];
+
+    timer = *slot;
+    *slot = NULL;
+
+    for ( ; timer; timer = next )
+    {
+        next = timer->next;
+        wheel_insert ( wheel, timer );
+    }
+}
+
+/**
+ * Get earliest tick the wheel must be advanced to, zero if empty
+ */
+static uint64_t wheel_next ( const struct wheel_t *wheel )
+{
+    int level;
+    uint64_t i;
+    uint64_t block;
+    uint64_t next = 0;
+
+    /* Higher levels are due when their slot cascades */
+    for ( level = 0; level < WHEEL_LEVELS; level++ )
+    {
+        block = wheel->tick >> ( WHEEL_BITS * level );
+
+        for ( i = 1; i <= WHEEL_SLOTS; i++ )
+        {
+            if ( wheel->slots[level][( block + i ) & WHEEL_MASK] )
+            {
+                if ( !next || ( block + i ) << ( WHEEL_BITS * level ) < next )
+                {
+                    next = ( block + i ) << ( WHEEL_BITS * level );
+                }
+                break;
+            }
+        }
+    }
+
+    return next;
+}
+
+/**
+ * Set timer fd to fire at the tick
+ */
+static void wheel_arm ( struct wheel_t *wheel, uint64_t tick )
+{
+    uint64_t msec;
+    struct itimerspec spec = { 0 };
+
+    /* Zero disarms the timer fd */
+    if ( tick )
+    {
+        msec = wheel->origin_msec + tick * TIMER_TICK_MSEC;
+        spec.it_value.tv_sec = msec / 1000;
+        spec.it_value.tv_nsec = ( msec % 1000 ) * 1000000;
+    }
+
+    if ( timerfd_settime ( wheel->event_stream->fd, TFD_TIMER_ABSTIME, &spec, NULL ) < 0 )
+    {
+        failure ( "cannot arm timer wheel (%i)\n", errno );
+        return;
+    }
+
+    wheel->armed = tick;
+}
+
+/**
+ * Register timer wheel with the proxy
+ */
+int timer_attach ( struct proxy_t *proxy )
+{
+    int fd;
+    struct wheel_t *wheel;
+    struct stream_t *stream;
+
+    if ( !( wheel = calloc ( 1, sizeof ( struct wheel_t ) ) ) )
+    {
+        return -1;
+    }
+
+    if ( ( fd = timerfd_create ( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC ) ) < 0 )
+    {
+        failure ( "cannot create timer wheel (%i)\n", errno );
+        free ( wheel );
+        return -1;
+    }
+
+    if ( !( stream = insert_stream ( proxy, fd ) ) )
+    {
+        close ( fd );
+        free ( wheel );
+        return -1;
+    }
+
+    stream->role = L_TIMER;
+    stream->events = POLLIN;
+    wheel->event_stream = stream;
+    wheel->origin_msec = sc_clock_usec (  ) / 1000;
+    proxy->wheel = wheel;
+
+    return 0;
+}
+
+/**
+ * Unregister timer wheel from the proxy
+ */
+void timer_detach ( struct proxy_t *proxy )
+{
+    /* Streams are removed first, timer fd is closed along with its stream */
+    free ( proxy->wheel );
+    proxy->wheel = NULL;
+}
+
+/**
+ * Cancel stream timeout
+ */
+void timer_release ( struct stream_t *stream )
+{
+    if ( stream->timer.wheel )
+    {
+        wheel_remove ( stream->timer.wheel, &stream->timer );
+        stream->timer.wheel = NULL;
+    }
+}
+
+/**
+ * Arm stream timeout
+ */
+static void timer_arm ( struct wheel_t *wheel, struct stream_t *stream, int sec )
+{
+    int level;
+    uint64_t due;
+    uint64_t now = wheel_now ( wheel );
+
+    /* Empty wheel skips idle ticks at once */
+    if ( !wheel->count )
+    {
+        wheel->tick = now;
+    }
+
+    stream->timer.expires = now + ( ( uint64_t ) sec * 1000 + TIMER_TICK_MSEC - 1 ) / TIMER_TICK_MSEC;
+    stream->timer.wheel = wheel;
+    wheel_insert ( wheel, &stream->timer );
+    wheel->count++;
+
+    /* Higher level timer is due when its slot cascades */
+    level = wheel_level ( wheel, stream->timer.expires );
+    due = stream->timer.expires >> ( WHEEL_BITS * level ) << ( WHEEL_BITS * level );
+
+    if ( due <= wheel->tick )
+    {
+        due = wheel->tick + 1;
+    }
+
+    if ( !wheel->armed || due < wheel->armed )
+    {
+        wheel_arm ( wheel, due );
+    }
+}
+
+/**
+ * Arm connect or idle timeout of the relation, by stream level
+ */
+void timer_track ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int sec;
+
+    if ( !proxy->wheel )
+    {
+        return;
+    }
+
+    timer_release ( stream );
+
+    sec = stream->level == LEVEL_FORWARDING ? proxy->idle_timeout : proxy->connect_timeout;
+
+    if ( !sec )
+    {
+        return;
+    }
+
+    /* Activity is compared at expiry, so traffic never touches the wheel */
+    stream->idle_mark = stream->nbytes + ( stream->neighbour ? stream->neighbour->nbytes : 0 );
+    timer_arm ( proxy->wheel, stream, sec );
+}
+
+/**
+ * Let the kernel detect dead peers of the socket
+ */
+void timer_keepalive ( struct proxy_t *proxy, int sock )
+{
+    int on = 1;
+    int idle;
+    int interval;
+    int count = KEEPALIVE_PROBES;
+    unsigned int user_timeout;
+
+    if ( !proxy->peer_timeout )
+    {
+        return;
+    }
+
+    /* Half of the timeout quiet, then probes over the other half */
+    idle = proxy->peer_timeout / 2 > 0 ? proxy->peer_timeout / 2 : 1;
+    interval = proxy->peer_timeout / ( 2 * count ) > 0 ? proxy->peer_timeout / ( 2 * count ) : 1;
+    user_timeout = proxy->peer_timeout * 1000;
+
+    if ( setsockopt ( sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof ( on ) ) < 0
+        || setsockopt ( sock, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof ( idle ) ) < 0
+        || setsockopt ( sock, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof ( interval ) ) < 0
+        || setsockopt ( sock, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof ( count ) ) < 0
+        || setsockopt ( sock, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout,
+            sizeof ( user_timeout ) ) < 0 )
+    {
+        failure ( "cannot set keepalive on socket:%i (%i)\n", sock, errno );
+    }
+}
+
+/**
+ * Handle expiry of stream timeout
+ */
+static void timer_expire ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    unsigned long long mark;
+
+    if ( stream->abandoned )
+    {
+        return;
+    }
+
+    if ( stream->level == LEVEL_FORWARDING )
+    {
+        mark = stream->nbytes + ( stream->neighbour ? stream->neighbour->nbytes : 0 );
+
+        /* Relation was active since last check, start over */
+        if ( mark != stream->idle_mark )
+        {
+            stream->idle_mark = mark;
+            timer_arm ( proxy->wheel, stream, proxy->idle_timeout );
+            return;
+        }
+
+        verbose ( "idle timeout on socket:%i\n", stream->fd );
+
+    } else
+    {
+        verbose ( "connect timeout on socket:%i\n", stream->fd );
+    }
+
+    /* Both streams are removed through the ready list */
+    remove_relation ( stream );
+    schedule_stream ( proxy, stream );
+
+    if ( stream->neighbour )
+    {
+        schedule_stream ( proxy, stream->neighbour );
+    }
+}
+
+/**
+ * Handle expired timeouts
+ */
+int timer_events ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    int level;
+    uint64_t now;
+    uint64_t count;
+    struct wheel_timer_t *timer;
+    struct wheel_timer_t **slot;
+    struct wheel_t *wheel = proxy->wheel;
+
+    if ( ~stream->revents & POLLIN )
+    {
+        return -1;
+    }
+
+    if ( read ( stream->fd, &count, sizeof ( count ) ) < 0 && errno != EAGAIN )
+    {
+        failure ( "cannot read timer wheel (%i)\n", errno );
+        return -1;
+    }
+
+    stream_would_block ( stream, POLLIN );
+
+    wheel->armed = 0;
+    now = wheel_now ( wheel );
+
+    while ( wheel->count && wheel->tick < now )
+    {
+        wheel->tick++;
+
+        /* Crossing a slot boundary brings its timers one level down */
+        for ( level = WHEEL_LEVELS - 1; level > 0; level-- )
+        {
+            if ( !( wheel->tick & ( ( ( uint64_t ) 1 << ( WHEEL_BITS * level ) ) - 1 ) ) )
+            {
+                wheel_cascade ( wheel, level );
+            }
+        }
+
+        slot = &wheel->slots[0][wheel->tick & WHEEL_MASK];
+
+        while ( ( timer = *slot ) )
+        {
+            wheel_remove ( wheel, timer );
+            timer->wheel = NULL;
+            timer_expire ( proxy, ( struct stream_t * ) ( ( char * ) timer
+                    - offsetof ( struct stream_t, timer ) ) );
+        }
+    }
+
+    if ( !wheel->count )
+    {
+        wheel->tick = now;
+    }
+
+    wheel_arm ( wheel, wheel_next ( wheel ) );
+
+    return 0;
+}
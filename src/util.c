@@ -2,9 +2,16 @@
  * Proxy Util - Source File
  * ------------------------------------------------------------------ */
 
+#define _GNU_SOURCE
 #define PROXY_UTIL_BASE_STRUCTS
 #include "util.h"
 
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
 /* NOTE: Netowrk Address Related Functions */
 
 /**
@@ -261,6 +268,19 @@ int listen_socket ( struct proxy_t *proxy, const struct sockaddr_storage *saddr
 
     verbose ( "done setting reuse address on socket:%i\n", sock );
 
+    /* Let sibling workers share the same port */
+    if ( proxy->reuse_port )
+    {
+        if ( setsockopt ( sock, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof ( yes ) ) < 0 )
+        {
+            failure ( "cannot reuse port (%i) on socket:%i\n", errno, sock );
+            shutdown_then_close ( proxy, sock );
+            return -1;
+        }
+
+        verbose ( "done setting reuse port on socket:%i\n", sock );
+    }
+
     /* Bind socket to address */
     if ( bind ( sock, ( const struct sockaddr * ) saddr, sizeof ( struct sockaddr_storage ) ) < 0 )
     {
@@ -272,7 +292,7 @@ int listen_socket ( struct proxy_t *proxy, const struct sockaddr_storage *saddr
     verbose ( "bound socket:%i to network address\n", sock );
 
     /* Put socket into listen mode */
-    if ( listen ( sock, LISTEN_BACKLOG ) < 0 )
+    if ( listen ( sock, proxy->listen_backlog > 0 ? proxy->listen_backlog : LISTEN_BACKLOG ) < 0 )
     {
         failure ( "cannot put socket:%i in listen mode (%i)\n", sock, errno );
         shutdown_then_close ( proxy, sock );
@@ -281,6 +301,13 @@ int listen_socket ( struct proxy_t *proxy, const struct sockaddr_storage *saddr
 
     verbose ( "put socket:%i into listen mode\n", sock );
 
+    /* Edge-triggered accept must stop at EAGAIN */
+    if ( socket_set_nonblocking ( proxy, sock ) < 0 )
+    {
+        shutdown_then_close ( proxy, sock );
+        return -1;
+    }
+
     return sock;
 }
 
@@ -331,113 +358,6 @@ int socket_set_nonblocking ( struct proxy_t *proxy, int sock )
     return 0;
 }
 
-/**
- * Forward data between sockets
- */
-int socket_forward_data ( struct proxy_t *proxy, int srcfd, int dstfd )
-{
-    int len = FORWARD_CHUNK_LEN;
-    int recvlim;
-    int sendlim;
-    int sendwip;
-    socklen_t optlen;
-    uint8_t buffer[FORWARD_CHUNK_LEN];
-
-    UNUSED ( proxy );
-
-    if ( ioctl ( srcfd, FIONREAD, &recvlim ) < 0 )
-    {
-        failure ( "cannot get socket:%i available bytes count (%i)\n", srcfd, errno );
-        return -1;
-    }
-
-    if ( !recvlim )
-    {
-        verbose ( "lost connection on socket:%i\n", srcfd );
-        return -1;
-    }
-
-    verbose ( "socket:%i available bytes count: %i\n", srcfd, recvlim );
-
-    if ( recvlim < len )
-    {
-        len = recvlim;
-        verbose ( "bytes count limited to buffer size: %i\n", len );
-    }
-
-    if ( ioctl ( dstfd, TIOCOUTQ, &sendwip ) < 0 )
-    {
-        failure ( "cannot get socket:%i pending bytes count (%i)\n", dstfd, errno );
-        return -1;
-    }
-
-    verbose ( "socket:%i pending bytes count: %i\n", dstfd, sendwip );
-
-    optlen = sizeof ( sendlim );
-
-    if ( getsockopt ( dstfd, SOL_SOCKET, SO_SNDBUF, &sendlim, &optlen ) < 0 )
-    {
-        failure ( "cannot get socket:%i output capacity (%i)\n", dstfd, errno );
-        return -1;
-    }
-
-    if ( optlen != sizeof ( sendlim ) )
-    {
-        failure ( "socket:%i output capacity data type is invalid\n", dstfd );
-        return -1;
-    }
-
-    verbose ( "socket:%i output capacity: %i\n", dstfd, sendlim );
-
-    if ( sendwip > sendlim )
-    {
-        failure ( "socket:%i capacity is less than data pending\n", dstfd );
-        return -1;
-    }
-
-    sendlim -= sendwip;
-
-    if ( !sendlim )
-    {
-        failure ( "socket:%i was expected to be write ready\n", dstfd );
-        return -1;
-    }
-
-    if ( sendlim < len )
-    {
-        len = sendlim;
-        verbose ( "bytes count limited to socket:%i output capacity: %i\n", dstfd, len );
-    }
-
-    if ( !len )
-    {
-        verbose ( "socket:%i no data to be transfered into\n", dstfd );
-        return -1;
-    }
-
-    if ( recv ( srcfd, buffer, len, MSG_PEEK ) < len )
-    {
-        failure ( "cannot receive data from socket:%i\n", srcfd );
-        return -1;
-    }
-
-    if ( ( len = send ( dstfd, buffer, len, MSG_NOSIGNAL ) ) < 0 )
-    {
-        failure ( "cannot send data to socket:%i\n", dstfd );
-        return -1;
-    }
-
-    if ( recv ( srcfd, buffer, len, 0 ) < len )
-    {
-        failure ( "cannot skip data from socket:%i\n", srcfd );
-        return -1;
-    }
-
-    verbose ( "forwarded %i byte(s) from socket:%i to socket:%i\n", len, srcfd, dstfd );
-
-    return len;
-}
-
 /**
  * Shutdown and close the socket
  */
@@ -527,241 +447,301 @@ int check_enough_data ( struct proxy_t *proxy, struct stream_t *stream, size_t v
 
 /* NOTE: Event Listenning Related Functions */
 
+/* io_uring user data is stream pointer tagged with generation, low bits tell the operation */
+#define URING_PTR_MASK              ((1ULL << 48) - 1)
+#define URING_OP_MASK               3ULL
+#define URING_USER_DATA(STREAM) \
+    ((uint64_t) (uintptr_t) (STREAM) | ((uint64_t) ((STREAM)->uring_gen & 0xffff) << 48))
+
 /**
- * Setup proxy events listenning
+ * io_uring instance with mapped rings
  */
-int proxy_events_setup ( struct proxy_t *proxy )
+struct uring_t
 {
-    /* Create epoll fd if possible */
-    if ( ( proxy->epoll_fd = epoll_create ( 0 ) ) >= 0 )
+    int fd;
+    int nfiles;
+    unsigned int pending;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+};
+
+/**
+ * Unmap and close io_uring instance
+ */
+static void uring_free ( struct uring_t *ring )
+{
+    if ( ring->sqes )
     {
-        verbose ( "epoll initialized\n" );
+        munmap ( ring->sqes, ring->sqes_size );
+    }
 
-    } else
+    if ( ring->cq_ptr && ring->cq_ptr != ring->sq_ptr )
     {
-        if ( ( proxy->epoll_fd = epoll_create1 ( 0 ) ) >= 0 )
-        {
-            verbose ( "epoll-1 initialized\n" );
+        munmap ( ring->cq_ptr, ring->cq_size );
+    }
 
-        } else
-        {
-            verbose ( "epoll not supported\n" );
-        }
+    if ( ring->sq_ptr )
+    {
+        munmap ( ring->sq_ptr, ring->sq_size );
     }
 
-    return 0;
+    close ( ring->fd );
+    free ( ring );
 }
 
 /**
- * Build stream event list with poll
+ * Register sparse file table, sockets are added as streams come
  */
-int build_poll_list ( struct proxy_t *proxy, struct pollfd *poll_list, size_t *poll_len )
+static void uring_register_files ( struct uring_t *ring )
 {
-    size_t poll_size;
-    size_t poll_rlen = 0;
-    struct stream_t *iter;
-    struct pollfd *pollref;
-
-    poll_size = *poll_len;
+    int i;
+    int *fds;
+    struct rlimit limit;
 
-    /* Reset poll references */
-    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    if ( getrlimit ( RLIMIT_NOFILE, &limit ) < 0 )
     {
-        iter->pollref = NULL;
+        return;
     }
 
-    /* Append file descriptors to the poll list */
-    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    ring->nfiles = limit.rlim_cur < URING_FILES_MAX ? ( int ) limit.rlim_cur : URING_FILES_MAX;
+
+    if ( !( fds = malloc ( ring->nfiles * sizeof ( int ) ) ) )
     {
-        /* Assert poll list index */
-        if ( poll_rlen >= poll_size )
-        {
-            failure ( "poll list capacity exceeded\n" );
-            return -1;
-        }
+        ring->nfiles = 0;
+        return;
+    }
 
-        /* Add stream to poll list if applicable */
-        if ( iter->events )
-        {
-            pollref = poll_list + poll_rlen;
-            pollref->fd = iter->fd;
-            pollref->events = POLLERR | POLLHUP | iter->events;
-            iter->pollref = pollref;
-            poll_rlen++;
-            verbose ( "poll list push socket:%i with events: %s%s%s%s\n", pollref->fd,
-                POLL_EVENTS_TO_4xSTR ( pollref->events ) );
-        }
+    for ( i = 0; i < ring->nfiles; i++ )
+    {
+        fds[i] = -1;
     }
 
-    verbose ( "poll list length is %lu event(s)\n", ( unsigned long ) poll_rlen );
-    *poll_len = poll_rlen;
+    if ( syscall ( __NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds,
+            ring->nfiles ) < 0 )
+    {
+        ring->nfiles = 0;
+    }
 
-    return 0;
+    free ( fds );
 }
 
 /**
- * Update streams revents with poll
+ * Create io_uring instance
  */
-void update_revents_poll ( struct proxy_t *proxy )
+static int uring_setup ( struct proxy_t *proxy )
 {
-    struct stream_t *iter;
+    unsigned int i;
+    uint8_t *sq;
+    uint8_t *cq;
+    struct uring_t *ring;
+    struct io_uring_params params;
 
-    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    if ( !( ring = calloc ( 1, sizeof ( struct uring_t ) ) ) )
     {
-        iter->revents = iter->pollref ? iter->pollref->revents : 0;
-        if ( proxy->verbose )
-        {
-            if ( iter->revents )
-            {
-                verbose ( "events returned for socket:%i: %s%s%s%s\n", iter->fd,
-                    POLL_EVENTS_TO_4xSTR ( iter->revents ) );
-            }
-        }
+        return -1;
     }
-}
-
-/**
- * Watch stream events with poll
- */
-int watch_streams_poll ( struct proxy_t *proxy )
-{
-    int nfds;
-    size_t poll_len;
-    struct pollfd poll_list[POOL_SIZE];
 
-    /* Set poll list size */
-    poll_len = sizeof ( poll_list ) / sizeof ( struct pollfd );
+    memset ( &params, '\0', sizeof ( params ) );
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_CQ_ENTRIES;
 
-    /* Rebuild poll event list */
-    if ( build_poll_list ( proxy, poll_list, &poll_len ) < 0 )
+    if ( ( ring->fd = syscall ( __NR_io_uring_setup, URING_SQ_ENTRIES, &params ) ) < 0 )
     {
-        failure ( "building poll list failed (%i)\n", errno );
+        free ( ring );
         return -1;
     }
 
-    /* Poll events */
-    if ( ( nfds = poll ( poll_list, poll_len, POLL_TIMEOUT_MSEC ) ) < 0 )
+    /* Multishot poll came along with resource tags, wait timeout needs extended args */
+    if ( ~params.features & IORING_FEAT_RSRC_TAGS || ~params.features & IORING_FEAT_EXT_ARG )
     {
-        failure ( "poll events failed (%i)\n", errno );
+        close ( ring->fd );
+        free ( ring );
+        errno = ENOSYS;
         return -1;
     }
 
-    /* Print stats */
-    if (nfds > 0)
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof ( unsigned int );
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof ( struct io_uring_cqe );
+    ring->sqes_size = params.sq_entries * sizeof ( struct io_uring_sqe );
+
+    if ( params.features & IORING_FEAT_SINGLE_MMAP && ring->cq_size > ring->sq_size )
     {
-        verbose ( "found %i event%s with poll\n" , nfds, nfds == 1 ? "" : "s");
+        ring->sq_size = ring->cq_size;
     }
 
-    /* Update stream poll revents */
-    update_revents_poll ( proxy );
-
-    return nfds;
-}
+    if ( ( ring->sq_ptr =
+            mmap ( NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_SQ_RING ) ) == MAP_FAILED )
+    {
+        ring->sq_ptr = NULL;
+        uring_free ( ring );
+        return -1;
+    }
 
-/**
- * Convert poll to epoll events
- */
-int poll_to_epoll_events ( int poll_events )
-{
-    int epoll_events = 0;
+    if ( params.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        ring->cq_ptr = ring->sq_ptr;
 
-    if ( poll_events & POLLERR )
+    } else if ( ( ring->cq_ptr =
+            mmap ( NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_CQ_RING ) ) == MAP_FAILED )
     {
-        epoll_events |= EPOLLERR;
+        ring->cq_ptr = NULL;
+        uring_free ( ring );
+        return -1;
     }
 
-    if ( poll_events & POLLHUP )
+    if ( ( ring->sqes =
+            mmap ( NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring->fd, IORING_OFF_SQES ) ) == MAP_FAILED )
     {
-        epoll_events |= EPOLLHUP;
+        ring->sqes = NULL;
+        uring_free ( ring );
+        return -1;
     }
 
-    if ( poll_events & POLLIN )
+    sq = ring->sq_ptr;
+    cq = ring->cq_ptr;
+
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = ( unsigned int * ) ( sq + params.sq_off.head );
+    ring->sq_tail = ( unsigned int * ) ( sq + params.sq_off.tail );
+    ring->sq_mask = ( unsigned int * ) ( sq + params.sq_off.ring_mask );
+    ring->cq_head = ( unsigned int * ) ( cq + params.cq_off.head );
+    ring->cq_tail = ( unsigned int * ) ( cq + params.cq_off.tail );
+    ring->cq_mask = ( unsigned int * ) ( cq + params.cq_off.ring_mask );
+    ring->cqes = ( struct io_uring_cqe * ) ( cq + params.cq_off.cqes );
+
+    /* Submission slots map to entries one to one */
+    for ( i = 0; i < params.sq_entries; i++ )
     {
-        epoll_events |= EPOLLIN;
+        ( ( unsigned int * ) ( sq + params.sq_off.array ) )[i] = i;
     }
 
-    if ( poll_events & POLLOUT )
+    /* Files of linked requests are looked up when they run, so the table fills on the fly */
+    if ( params.features & IORING_FEAT_LINKED_FILE )
     {
-        epoll_events |= EPOLLOUT;
+        uring_register_files ( ring );
     }
 
-    return epoll_events;
+    proxy->uring = ring;
+
+    return 0;
 }
 
 /**
- * Convert epoll to poll events
+ * Submit queued entries, optionally waiting for a completion
  */
-int epoll_to_poll_events ( int epoll_events )
+static int uring_enter ( struct uring_t *ring, int timeout )
 {
-    int poll_events = 0;
+    int status;
+    unsigned int flags = 0;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
 
-    if ( epoll_events & EPOLLERR )
-    {
-        poll_events |= POLLERR;
-    }
+    memset ( &arg, '\0', sizeof ( arg ) );
 
-    if ( epoll_events & EPOLLHUP )
+    /* Negative timeout waits without limit */
+    if ( timeout > 0 )
     {
-        poll_events |= POLLHUP;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = ( timeout % 1000 ) * 1000000;
+        arg.ts = ( uint64_t ) ( uintptr_t ) & ts;
     }
 
-    if ( epoll_events & EPOLLIN )
+    if ( timeout )
     {
-        poll_events |= POLLIN;
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
     }
 
-    if ( epoll_events & EPOLLOUT )
+    status =
+        syscall ( __NR_io_uring_enter, ring->fd, ring->pending, timeout ? 1 : 0, flags,
+        timeout ? &arg : NULL, timeout ? sizeof ( arg ) : 0 );
+
+    /* Kernel moves submission head past consumed entries */
+    ring->pending = *ring->sq_tail - __atomic_load_n ( ring->sq_head, __ATOMIC_ACQUIRE );
+
+    if ( status < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN )
     {
-        poll_events |= POLLOUT;
+        return -1;
     }
 
-    return epoll_events;
+    return 0;
 }
 
 /**
- * Build stream event list with epoll
+ * Get next free submission entry
  */
-int build_epoll_list ( struct proxy_t *proxy )
+static struct io_uring_sqe *uring_get_sqe ( struct uring_t *ring )
 {
-    int operation;
-    struct stream_t *iter;
-    struct epoll_event event;
+    unsigned int tail = *ring->sq_tail;
+    struct io_uring_sqe *sqe;
 
-    /* Append file descriptors to the poll list */
-    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    /* Flush queue once full */
+    if ( tail - __atomic_load_n ( ring->sq_head, __ATOMIC_ACQUIRE ) >= ring->sq_entries )
     {
-        if ( iter->events )
+        if ( uring_enter ( ring, 0 ) < 0 || ring->pending >= ring->sq_entries )
         {
-            if ( !iter->pollref || iter->events != iter->levents )
-            {
-                event.data.ptr = iter;
-                event.events = poll_to_epoll_events ( iter->events | POLLERR | POLLHUP );
-                operation = iter->pollref ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            return NULL;
+        }
+    }
 
-                if ( epoll_ctl ( proxy->epoll_fd, operation, iter->fd, &event ) < 0 )
-                {
-                    failure ( "epoll list cannot update socket:%i with events 0x%.2x\n", iter->fd,
-                        event.events );
-                    return -1;
-                }
+    sqe = &ring->sqes[tail & *ring->sq_mask];
+    memset ( sqe, '\0', sizeof ( struct io_uring_sqe ) );
 
-                verbose ( "epoll list updated socket:%i with events: %s%s%s%s\n", iter->fd,
-                    EPOLL_EVENTS_TO_4xSTR ( event.events ) );
+    __atomic_store_n ( ring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+    ring->pending++;
 
-                iter->levents = iter->events;
-                iter->pollref = EPOLLREF;
-            }
+    return sqe;
+}
+
+/**
+ * Setup proxy events listenning
+ */
+int proxy_events_setup ( struct proxy_t *proxy )
+{
+    proxy->uring = NULL;
+    proxy->uring_seq = 0;
 
-        } else if ( iter->pollref )
+    /* Prefer io_uring if requested and supported */
+    if ( proxy->use_uring )
+    {
+        if ( uring_setup ( proxy ) >= 0 )
         {
-            verbose ( "epoll list removed socket:%i\n", proxy->epoll_fd );
+            proxy->epoll_fd = -1;
+            verbose ( "io_uring initialized\n" );
+            return 0;
+        }
 
-            if ( epoll_ctl ( proxy->epoll_fd, EPOLL_CTL_DEL, iter->fd, NULL ) < 0 )
-            {
-                return -1;
-            }
+        verbose ( "io_uring not supported (%i), falling back\n", errno );
+    }
+
+    /* Create epoll fd if possible */
+    if ( ( proxy->epoll_fd = epoll_create ( 0 ) ) >= 0 )
+    {
+        verbose ( "epoll initialized\n" );
+
+    } else
+    {
+        if ( ( proxy->epoll_fd = epoll_create1 ( 0 ) ) >= 0 )
+        {
+            verbose ( "epoll-1 initialized\n" );
 
-            iter->pollref = NULL;
+        } else
+        {
+            verbose ( "epoll not supported\n" );
         }
     }
 
@@ -769,68 +749,735 @@ int build_epoll_list ( struct proxy_t *proxy )
 }
 
 /**
- * Update streams revents with poll
+ * Release proxy events listenning
  */
-void update_revents_epoll ( struct proxy_t *proxy, int nfds, struct epoll_event *events )
+void proxy_events_close ( struct proxy_t *proxy )
 {
-    int i;
-    struct stream_t *stream;
+    if ( proxy->epoll_fd >= 0 )
+    {
+        close ( proxy->epoll_fd );
+        proxy->epoll_fd = -1;
+    }
+
+    if ( proxy->uring )
+    {
+        uring_free ( proxy->uring );
+        proxy->uring = NULL;
+    }
+}
+
+/**
+ * Append stream to the ready list
+ */
+void schedule_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( stream->scheduled )
+    {
+        return;
+    }
+
+    stream->ready_prev = proxy->ready_tail;
+    stream->ready_next = NULL;
+
+    if ( proxy->ready_tail )
+    {
+        proxy->ready_tail->ready_next = stream;
+
+    } else
+    {
+        proxy->ready_head = stream;
+    }
+
+    proxy->ready_tail = stream;
+    proxy->ready_len++;
+    stream->scheduled = 1;
+}
+
+/**
+ * Remove stream from the ready list
+ */
+static void unschedule_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( !stream->scheduled )
+    {
+        return;
+    }
+
+    if ( stream->ready_prev )
+    {
+        stream->ready_prev->ready_next = stream->ready_next;
+
+    } else
+    {
+        proxy->ready_head = stream->ready_next;
+    }
+
+    if ( stream->ready_next )
+    {
+        stream->ready_next->ready_prev = stream->ready_prev;
+
+    } else
+    {
+        proxy->ready_tail = stream->ready_prev;
+    }
+
+    stream->ready_prev = NULL;
+    stream->ready_next = NULL;
+    proxy->ready_len--;
+    stream->scheduled = 0;
+}
+
+/**
+ * Move relation to the front of the eviction order
+ */
+void touch_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    /* Relation is represented by its accepted stream */
+    if ( stream->role != S_PORT_A && !( stream = stream->neighbour ) )
+    {
+        return;
+    }
+
+    if ( stream == proxy->lru_head )
+    {
+        return;
+    }
+
+    if ( stream->lru_prev )
+    {
+        stream->lru_prev->lru_next = stream->lru_next;
+
+        if ( stream->lru_next )
+        {
+            stream->lru_next->lru_prev = stream->lru_prev;
+
+        } else
+        {
+            proxy->lru_tail = stream->lru_prev;
+        }
+
+    } else if ( !proxy->lru_tail )
+    {
+        proxy->lru_tail = stream;
+    }
+
+    stream->lru_prev = NULL;
+    stream->lru_next = proxy->lru_head;
+
+    if ( proxy->lru_head )
+    {
+        proxy->lru_head->lru_prev = stream;
+    }
+
+    proxy->lru_head = stream;
+}
+
+/**
+ * Take relation out of the eviction order
+ */
+static void untouch_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( stream->lru_prev )
+    {
+        stream->lru_prev->lru_next = stream->lru_next;
+
+    } else if ( stream == proxy->lru_head )
+    {
+        proxy->lru_head = stream->lru_next;
+
+    } else
+    {
+        return;
+    }
+
+    if ( stream->lru_next )
+    {
+        stream->lru_next->lru_prev = stream->lru_prev;
+
+    } else
+    {
+        proxy->lru_tail = stream->lru_prev;
+    }
+
+    stream->lru_prev = NULL;
+    stream->lru_next = NULL;
+}
+
+/**
+ * Schedule stream again if it still has work pending
+ */
+static void reschedule_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    if ( stream->abandoned || ( stream->lrevents & ( stream->events | POLLERR | POLLHUP ) ) )
+    {
+        schedule_stream ( proxy, stream );
+    }
+}
+
+/**
+ * Clear latched readiness once socket would block
+ */
+void stream_would_block ( struct stream_t *stream, short events )
+{
+    stream->lrevents &= ~events;
+}
+
+/**
+ * Build stream event list with poll
+ */
+int build_poll_list ( struct proxy_t *proxy, struct pollfd *poll_list, size_t *poll_len )
+{
+    size_t poll_size;
+    size_t poll_rlen = 0;
+    struct stream_t *iter;
+    struct pollfd *pollref;
+
+    poll_size = *poll_len;
+
+    /* Reset poll references */
+    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    {
+        iter->pollref = NULL;
+    }
+
+    /* Append file descriptors to the poll list */
+    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    {
+        /* Assert poll list index */
+        if ( poll_rlen >= poll_size )
+        {
+            failure ( "poll list capacity exceeded\n" );
+            return -1;
+        }
+
+        /* Add stream to poll list if applicable */
+        if ( iter->events )
+        {
+            pollref = poll_list + poll_rlen;
+            pollref->fd = iter->fd;
+            pollref->events = POLLERR | POLLHUP | iter->events;
+            iter->pollref = pollref;
+            poll_rlen++;
+            verbose ( "poll list push socket:%i with events: %s%s%s%s\n", pollref->fd,
+                POLL_EVENTS_TO_4xSTR ( pollref->events ) );
+        }
+    }
+
+    verbose ( "poll list length is %lu event(s)\n", ( unsigned long ) poll_rlen );
+    *poll_len = poll_rlen;
+
+    return 0;
+}
+
+/**
+ * Update streams revents with poll
+ */
+void update_revents_poll ( struct proxy_t *proxy )
+{
+    struct stream_t *iter;
+
+    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    {
+        iter->lrevents = iter->pollref ? iter->pollref->revents : 0;
+        if ( iter->lrevents )
+        {
+            verbose ( "events returned for socket:%i: %s%s%s%s\n", iter->fd,
+                POLL_EVENTS_TO_4xSTR ( iter->lrevents ) );
+            schedule_stream ( proxy, iter );
+        }
+    }
+}
+
+/**
+ * Watch stream events with poll
+ */
+int watch_streams_poll ( struct proxy_t *proxy )
+{
+    int nfds;
+    size_t poll_len;
+    struct pollfd *poll_list;
+
+    /* Grow poll list along with the stream slab */
+    if ( proxy->poll_size < proxy->stream_count )
+    {
+        if ( !( poll_list =
+                realloc ( proxy->poll_list, proxy->stream_capacity * sizeof ( struct pollfd ) ) ) )
+        {
+            failure ( "cannot allocate poll list (%i)\n", errno );
+            return -1;
+        }
+
+        proxy->poll_list = poll_list;
+        proxy->poll_size = proxy->stream_capacity;
+    }
+
+    poll_list = proxy->poll_list;
+    poll_len = proxy->poll_size;
+
+    /* Rebuild poll event list */
+    if ( build_poll_list ( proxy, poll_list, &poll_len ) < 0 )
+    {
+        failure ( "building poll list failed (%i)\n", errno );
+        return -1;
+    }
+
+    /* Poll events */
+    if ( ( nfds = poll ( poll_list, poll_len, POLL_TIMEOUT_MSEC ) ) < 0 )
+    {
+        failure ( "poll events failed (%i)\n", errno );
+        return -1;
+    }
+
+    /* Print stats */
+    if (nfds > 0)
+    {
+        verbose ( "found %i event%s with poll\n" , nfds, nfds == 1 ? "" : "s");
+    }
+
+    /* Update stream poll revents */
+    update_revents_poll ( proxy );
+
+    return nfds;
+}
+
+/**
+ * Convert poll to epoll events
+ */
+int poll_to_epoll_events ( int poll_events )
+{
+    int epoll_events = 0;
+
+    if ( poll_events & POLLERR )
+    {
+        epoll_events |= EPOLLERR;
+    }
+
+    if ( poll_events & POLLHUP )
+    {
+        epoll_events |= EPOLLHUP;
+    }
+
+    if ( poll_events & POLLIN )
+    {
+        epoll_events |= EPOLLIN;
+    }
+
+    if ( poll_events & POLLOUT )
+    {
+        epoll_events |= EPOLLOUT;
+    }
+
+    if ( poll_events & POLLRDHUP )
+    {
+        epoll_events |= EPOLLRDHUP;
+    }
+
+    return epoll_events;
+}
+
+/**
+ * Convert epoll to poll events
+ */
+int epoll_to_poll_events ( int epoll_events )
+{
+    int poll_events = 0;
+
+    if ( epoll_events & EPOLLERR )
+    {
+        poll_events |= POLLERR;
+    }
+
+    if ( epoll_events & EPOLLHUP )
+    {
+        poll_events |= POLLHUP;
+    }
+
+    if ( epoll_events & EPOLLIN )
+    {
+        poll_events |= POLLIN;
+    }
+
+    if ( epoll_events & EPOLLOUT )
+    {
+        poll_events |= POLLOUT;
+    }
+
+    if ( epoll_events & EPOLLRDHUP )
+    {
+        poll_events |= POLLRDHUP;
+    }
+
+    return poll_events;
+}
+
+/**
+ * Update streams revents with epoll
+ */
+void update_revents_epoll ( struct proxy_t *proxy, int nfds, struct epoll_event *events )
+{
+    int i;
+    struct stream_t *stream;
+
+    /* Edges are latched until the socket would block */
+    for ( i = 0; i < nfds; i++ )
+    {
+        if ( ( stream = events[i].data.ptr ) )
+        {
+            stream->lrevents |= epoll_to_poll_events ( events[i].events );
+
+            verbose ( "events returned for socket:%i with events: %s%s%s%s\n", stream->fd,
+                POLL_EVENTS_TO_4xSTR ( stream->lrevents ) );
+
+            schedule_stream ( proxy, stream );
+        }
+    }
+}
+
+/**
+ * Watch stream events with epoll
+ */
+int watch_streams_epoll ( struct proxy_t *proxy )
+{
+    int nfds;
+    int timeout;
+    struct epoll_event events[EVENTS_BATCH_SIZE];
+
+    /* Do not sleep while latched work is pending */
+    timeout = proxy->ready_head ? 0 : POLL_TIMEOUT_MSEC;
+
+    /* E-Poll events */
+    if ( ( nfds = epoll_wait ( proxy->epoll_fd, events, EVENTS_BATCH_SIZE, timeout ) ) < 0 )
+    {
+        failure ( "epoll wait failed (%i)\n", errno );
+        return -1;
+    }
+
+    /* Print stats */
+    if (nfds > 0)
+    {
+        verbose ( "found %i event%s with epoll\n" , nfds, nfds == 1 ? "" : "s");
+    }
+
+    /* Update stream epoll revents */
+    update_revents_epoll ( proxy, nfds, events );
+
+    return ( int ) proxy->ready_len;
+}
+
+/* Registered file slot is cleared by pointing it at no file */
+static int uring_no_file = -1;
+
+/**
+ * Point submission entry at the socket, registered slot if there is one
+ */
+static void uring_set_file ( const struct uring_t *ring, struct io_uring_sqe *sqe, int fd )
+{
+    sqe->fd = fd;
+
+    if ( fd < ring->nfiles )
+    {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+}
+
+/**
+ * Set registered file slot of the socket
+ */
+static int uring_update_file ( struct uring_t *ring, int fd, int *file, int link )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( fd >= ring->nfiles )
+    {
+        return 0;
+    }
+
+    if ( !( sqe = uring_get_sqe ( ring ) ) )
+    {
+        return -1;
+    }
+
+    /* Following request runs even if the update fails, it then reports the error */
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = ( uint64_t ) ( uintptr_t ) file;
+    sqe->len = 1;
+    sqe->off = fd;
+    sqe->flags = link ? IOSQE_IO_HARDLINK : 0;
+    sqe->user_data = 0;
+
+    return 0;
+}
+
+/**
+ * Arm multishot poll for the stream
+ */
+static int uring_watch ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( !( sqe = uring_get_sqe ( proxy->uring ) ) )
+    {
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    uring_set_file ( proxy->uring, sqe, stream->fd );
+    sqe->poll32_events = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLRDHUP;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = URING_USER_DATA ( stream );
+
+    return 0;
+}
+
+/**
+ * Queue receive into the buffer with io_uring
+ */
+int stream_queue_recv ( struct proxy_t *proxy, struct stream_t *stream, uint8_t * buffer,
+    int len )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( !( sqe = uring_get_sqe ( proxy->uring ) ) )
+    {
+        return -1;
+    }
 
-    for ( stream = proxy->stream_head; stream; stream = stream->next )
+    sqe->opcode = IORING_OP_RECV;
+    uring_set_file ( proxy->uring, sqe, stream->fd );
+    sqe->addr = ( uint64_t ) ( uintptr_t ) buffer;
+    sqe->len = len;
+    sqe->user_data = URING_USER_DATA ( stream ) | URING_OP_RECV;
+
+    /* Buffer belongs to the kernel until the completion */
+    stream->uring_recv_buf = buffer;
+    stream->uring_ops |= URING_OP_RECV;
+
+    return 0;
+}
+
+/**
+ * Queue send of the iovec with io_uring
+ */
+int stream_queue_send ( struct proxy_t *proxy, struct stream_t *stream,
+    const struct iovec *iov, int iovcnt, int flags )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( !( sqe = uring_get_sqe ( proxy->uring ) ) )
     {
-        stream->revents = 0;
+        return -1;
     }
 
-    for ( i = 0; i < nfds; i++ )
+    /* Message header is read when the request runs, so it lives in the stream */
+    memcpy ( stream->uring_iov, iov, iovcnt * sizeof ( struct iovec ) );
+    memset ( &stream->uring_msg, '\0', sizeof ( stream->uring_msg ) );
+    stream->uring_msg.msg_iov = stream->uring_iov;
+    stream->uring_msg.msg_iovlen = iovcnt;
+
+    if ( iovcnt == 1 )
     {
-        if ( ( stream = events[i].data.ptr ) )
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = ( uint64_t ) ( uintptr_t ) iov[0].iov_base;
+        sqe->len = iov[0].iov_len;
+
+    } else
+    {
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = ( uint64_t ) ( uintptr_t ) & stream->uring_msg;
+        sqe->len = 1;
+    }
+
+    uring_set_file ( proxy->uring, sqe, stream->fd );
+    sqe->msg_flags = flags;
+    sqe->user_data = URING_USER_DATA ( stream ) | URING_OP_SEND;
+
+    stream->uring_ops |= URING_OP_SEND;
+
+    return 0;
+}
+
+/**
+ * Update streams revents with io_uring
+ */
+static void update_revents_uring ( struct proxy_t *proxy )
+{
+    int op;
+    unsigned int head;
+    unsigned int tail;
+    struct io_uring_cqe *cqe;
+    struct stream_t *stream;
+    struct uring_t *ring = proxy->uring;
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n ( ring->cq_tail, __ATOMIC_ACQUIRE );
+
+    for ( ; head != tail; head++ )
+    {
+        cqe = &ring->cqes[head & *ring->cq_mask];
+
+        if ( !cqe->user_data )
+        {
+            continue;
+        }
+
+        op = cqe->user_data & URING_OP_MASK;
+        stream = ( struct stream_t * ) ( uintptr_t ) ( cqe->user_data & URING_PTR_MASK
+            & ~URING_OP_MASK );
+
+        /* Skip completions of removed streams */
+        if ( !stream->allocated
+            || ( cqe->user_data & ~URING_OP_MASK ) != URING_USER_DATA ( stream ) )
+        {
+            continue;
+        }
+
+        /* Finished receive or send is handled like readiness */
+        if ( op )
         {
-            stream->revents = epoll_to_poll_events ( events[i].events );
+            stream->uring_ops &= ~op;
 
-            if ( proxy->verbose )
+            if ( cqe->res == -ECANCELED )
             {
-                if ( stream->revents )
-                {
-                    verbose ( "events returned for socket:%i with events: %s%s%s%s\n", stream->fd,
-                        POLL_EVENTS_TO_4xSTR ( stream->revents ) );
-                }
+                continue;
+            }
+
+            stream->uring_done |= op;
+
+            if ( op == URING_OP_RECV )
+            {
+                stream->uring_recv_res = cqe->res;
+                stream->lrevents |= POLLIN;
+
+            } else
+            {
+                stream->uring_send_res = cqe->res;
+                stream->lrevents |= POLLOUT;
+            }
+
+            schedule_stream ( proxy, stream );
+            continue;
+        }
+
+        if ( !stream->pollref || cqe->res == -ECANCELED )
+        {
+            continue;
+        }
+
+        if ( cqe->res < 0 )
+        {
+            stream->lrevents |= POLLERR;
+
+        } else
+        {
+            stream->lrevents |= epoll_to_poll_events ( cqe->res );
+
+            /* Multishot poll may be terminated, e.g. on ring overflow */
+            if ( ~cqe->flags & IORING_CQE_F_MORE && uring_watch ( proxy, stream ) < 0 )
+            {
+                stream->lrevents |= POLLERR;
             }
         }
+
+        verbose ( "events returned for socket:%i with events: %s%s%s%s\n", stream->fd,
+            POLL_EVENTS_TO_4xSTR ( stream->lrevents ) );
+
+        schedule_stream ( proxy, stream );
     }
+
+    __atomic_store_n ( ring->cq_head, head, __ATOMIC_RELEASE );
 }
 
 /**
- * Watch stream events with epoll
+ * Cancel socket operations of the stream and wait until the kernel lets go of its buffers
  */
-int watch_streams_epoll ( struct proxy_t *proxy )
+static void uring_cancel ( struct proxy_t *proxy, struct stream_t *stream )
 {
-    int nfds;
-    struct epoll_event events[POOL_SIZE];
+    int op;
+    struct io_uring_sqe *sqe;
 
-    /* Rebuild epoll event list */
-    if ( build_epoll_list ( proxy ) < 0 )
+    for ( op = URING_OP_RECV; op <= URING_OP_SEND; op <<= 1 )
     {
-        failure ( "building epoll list failed (%i)\n", errno );
-        return -1;
+        if ( stream->uring_ops & op && ( sqe = uring_get_sqe ( proxy->uring ) ) )
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = URING_USER_DATA ( stream ) | op;
+            sqe->user_data = 0;
+        }
     }
 
-    /* E-Poll events */
-    if ( ( nfds = epoll_wait ( proxy->epoll_fd, events, POOL_SIZE, POLL_TIMEOUT_MSEC ) ) < 0 )
+    while ( stream->uring_ops )
     {
-        failure ( "epoll wait failed (%i)\n", errno );
-        return -1;
+        if ( uring_enter ( proxy->uring, -1 ) < 0 )
+        {
+            failure ( "io_uring cannot cancel requests of socket:%i (%i)\n", stream->fd, errno );
+            return;
+        }
+
+        update_revents_uring ( proxy );
     }
+}
 
-    /* Print stats */
-    if (nfds > 0)
+/**
+ * Stop watching stream events
+ */
+void unwatch_stream ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    struct io_uring_sqe *sqe;
+
+    if ( !stream->pollref || stream->fd < 0 )
     {
-        verbose ( "found %i event%s with epoll\n" , nfds, nfds == 1 ? "" : "s");
+        return;
     }
 
-    /* Update stream epoll revents */
-    update_revents_epoll ( proxy, nfds, events );
+    if ( proxy->epoll_fd >= 0 )
+    {
+        epoll_ctl ( proxy->epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL );
 
-    return nfds;
+    } else if ( proxy->uring )
+    {
+        uring_cancel ( proxy, stream );
+
+        /* Poll holds a file reference until removed */
+        if ( ( sqe = uring_get_sqe ( proxy->uring ) ) )
+        {
+            sqe->opcode = IORING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = URING_USER_DATA ( stream );
+            sqe->user_data = 0;
+        }
+
+        /* So does the registered slot */
+        uring_update_file ( proxy->uring, stream->fd, &uring_no_file, 0 );
+    }
+
+    stream->pollref = NULL;
+}
+
+/**
+ * Watch stream events with io_uring
+ */
+int watch_streams_uring ( struct proxy_t *proxy )
+{
+    int timeout;
+    struct uring_t *ring = proxy->uring;
+
+    /* Do not sleep while latched work or completions are pending */
+    timeout = proxy->ready_head || *ring->cq_head != __atomic_load_n ( ring->cq_tail,
+        __ATOMIC_ACQUIRE ) ? 0 : POLL_TIMEOUT_MSEC;
+
+    /* Submission and wait share one syscall */
+    if ( ( timeout || ring->pending ) && uring_enter ( ring, timeout ) < 0 )
+    {
+        failure ( "io_uring wait failed (%i)\n", errno );
+        return -1;
+    }
+
+    /* Update stream io_uring revents */
+    update_revents_uring ( proxy );
+
+    return ( int ) proxy->ready_len;
 }
 
 /**
@@ -838,6 +1485,11 @@ int watch_streams_epoll ( struct proxy_t *proxy )
  */
 int watch_streams ( struct proxy_t *proxy )
 {
+    if ( proxy->uring )
+    {
+        return watch_streams_uring ( proxy );
+    }
+
     if ( proxy->epoll_fd >= 0 )
     {
         return watch_streams_epoll ( proxy );
@@ -849,36 +1501,138 @@ int watch_streams ( struct proxy_t *proxy )
 /* NOTE: Stream Related Functions */
 
 /**
- * Insert new stream structure into the list
+ * Stream slab chunk header
  */
-struct stream_t *insert_stream ( struct proxy_t *proxy, int sock )
+struct stream_chunk_t
+{
+    struct stream_chunk_t *next;
+    size_t nslots;
+};
+
+/**
+ * Grow stream slab by one chunk
+ */
+static int grow_streams ( struct proxy_t *proxy )
 {
-    struct stream_t *ptr;
-    struct stream_t *lim;
-    struct stream_t *stream = NULL;
+    size_t i;
+    size_t nslots;
+    uint8_t *slots;
+    struct stream_t *stream;
+    struct stream_chunk_t *chunk;
+
+    if ( proxy->stream_capacity >= proxy->stream_limit )
+    {
+        return -1;
+    }
+
+    nslots = proxy->stream_limit - proxy->stream_capacity;
+
+    if ( nslots > STREAM_CHUNK_SIZE )
+    {
+        nslots = STREAM_CHUNK_SIZE;
+    }
+
+    if ( !( chunk = malloc ( sizeof ( struct stream_chunk_t ) + nslots * proxy->stream_size ) ) )
+    {
+        failure ( "cannot allocate stream slab chunk (%i)\n", errno );
+        return -1;
+    }
+
+    chunk->next = proxy->stream_chunks;
+    chunk->nslots = nslots;
+    proxy->stream_chunks = chunk;
+    slots = ( uint8_t * ) ( chunk + 1 );
+
+    /* Push slots backwards, so that they are popped in address order */
+    for ( i = nslots; i > 0; i-- )
+    {
+        stream = ( struct stream_t * ) ( slots + ( i - 1 ) * proxy->stream_size );
+        stream->allocated = 0;
+        stream->next = proxy->stream_free;
+        proxy->stream_free = stream;
+    }
+
+    proxy->stream_capacity += nslots;
 
-    ptr = proxy->stream_pool;
-    lim =
-        ( struct stream_t * ) ( ( ( uint8_t * ) proxy->stream_pool ) +
-        POOL_SIZE * proxy->stream_size );
+    verbose ( "stream slab grown to %lu slots\n", ( unsigned long ) proxy->stream_capacity );
 
-    while ( ptr < lim )
+    return 0;
+}
+
+/**
+ * Ensure free stream slots are available
+ */
+int reserve_streams ( struct proxy_t *proxy, size_t count )
+{
+    while ( proxy->stream_capacity - proxy->stream_count < count )
     {
-        if ( !ptr->allocated )
+        if ( grow_streams ( proxy ) < 0 )
         {
-            stream = ptr;
-            break;
+            return -1;
         }
-        ptr = ( struct stream_t * ) ( ( ( uint8_t * ) ptr ) + proxy->stream_size );
     }
 
-    if ( !stream )
+    return 0;
+}
+
+/**
+ * Insert new stream structure into the list
+ */
+struct stream_t *insert_stream ( struct proxy_t *proxy, int sock )
+{
+    struct stream_t *stream;
+
+    if ( reserve_streams ( proxy, 1 ) < 0 )
     {
         failure ( "stream pool is full\n" );
         return NULL;
     }
 
+    stream = proxy->stream_free;
+    proxy->stream_free = stream->next;
+
     memset ( stream, '\0', proxy->stream_size );
+
+    /* Register interest once, readiness is latched on edges */
+    if ( proxy->epoll_fd >= 0 )
+    {
+        struct epoll_event event;
+
+        event.data.ptr = stream;
+        /* Peer shutdown is latched, end of stream queued behind data gives no new edge */
+        event.events = EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP | EPOLLRDHUP | EPOLLET;
+
+        if ( epoll_ctl ( proxy->epoll_fd, EPOLL_CTL_ADD, sock, &event ) < 0 )
+        {
+            failure ( "epoll list cannot add socket:%i (%i)\n", sock, errno );
+            stream->next = proxy->stream_free;
+            proxy->stream_free = stream;
+            return NULL;
+        }
+
+        verbose ( "epoll list added socket:%i\n", sock );
+
+        stream->pollref = EPOLLREF;
+
+    } else if ( proxy->uring )
+    {
+        stream->fd = sock;
+
+        /* Generation tells stale completions of a reused slot apart */
+        stream->uring_gen = ++proxy->uring_seq;
+
+        if ( uring_update_file ( proxy->uring, sock, &stream->fd, 1 ) < 0
+            || uring_watch ( proxy, stream ) < 0 )
+        {
+            failure ( "io_uring cannot watch socket:%i (%i)\n", sock, errno );
+            stream->next = proxy->stream_free;
+            proxy->stream_free = stream;
+            return NULL;
+        }
+
+        stream->pollref = EPOLLREF;
+    }
+
     stream->role = S_INVALID;
     stream->fd = sock;
     stream->level = LEVEL_NONE;
@@ -895,6 +1649,7 @@ struct stream_t *insert_stream ( struct proxy_t *proxy, int sock )
     }
 
     proxy->stream_head = stream;
+    proxy->stream_count++;
 
     verbose ( "created new stream with socket:%i\n", sock );
 
@@ -909,17 +1664,15 @@ struct stream_t *accept_new_stream ( struct proxy_t *proxy, int lfd )
     int sock;
     struct stream_t *stream;
 
-    /* Accept incoming connection */
-    if ( ( sock = accept ( lfd, NULL, NULL ) ) < 0 )
+    /* Accept incoming connection already in non-blocking mode */
+    if ( ( sock = accept4 ( lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) < 0 )
     {
-        failure ( "cannot accept incoming connection (%i) on socket:%i\n", errno, lfd );
-        return NULL;
-    }
+        if ( errno == EAGAIN || errno == EWOULDBLOCK )
+        {
+            return NULL;
+        }
 
-    /* Set non-blocking mode on socket */
-    if ( socket_set_nonblocking ( proxy, sock ) < 0 )
-    {
-        shutdown_then_close ( proxy, sock );
+        failure ( "cannot accept incoming connection (%i) on socket:%i\n", errno, lfd );
         return NULL;
     }
 
@@ -941,35 +1694,6 @@ struct stream_t *accept_new_stream ( struct proxy_t *proxy, int lfd )
     return stream;
 }
 
-/**
- * Handle stream data forward
- */
-int handle_forward_data ( struct proxy_t *proxy, struct stream_t *stream )
-{
-    if ( !stream->neighbour || stream->level != LEVEL_FORWARDING )
-    {
-        return -1;
-    }
-
-    if ( stream->revents & POLLOUT )
-    {
-        if ( socket_forward_data ( proxy, stream->neighbour->fd, stream->fd ) < 0 )
-        {
-            return -1;
-        }
-
-        stream->events &= ~POLLOUT;
-        stream->neighbour->events |= POLLIN;
-
-    } else if ( stream->revents & POLLIN )
-    {
-        stream->events &= ~POLLIN;
-        stream->neighbour->events |= POLLOUT;
-    }
-
-    return 0;
-}
-
 /**
  * Show relations statistics
  */
@@ -1007,7 +1731,7 @@ void show_stats ( struct proxy_t *proxy )
         }
 
         verbose ( "load: A:%i/%i B:%i/%i *:%i/%i\n", a_forwarding, a_total, b_forwarding,
-            b_total, total, POOL_SIZE );
+            b_total, total, ( int ) proxy->stream_limit );
     }
 }
 
@@ -1016,15 +1740,31 @@ void show_stats ( struct proxy_t *proxy )
  */
 void remove_stream ( struct proxy_t *proxy, struct stream_t *stream )
 {
+    if ( !stream->allocated )
+    {
+        return;
+    }
+
     if ( stream->fd >= 0 )
     {
-        if ( stream->pollref )
-        {
-            epoll_ctl ( proxy->epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL );
-        }
+        unwatch_stream ( proxy, stream );
 
+        handle_stream_release ( proxy, stream );
         shutdown_then_close ( proxy, stream->fd );
         stream->fd = -1;
+
+    } else
+    {
+        handle_stream_release ( proxy, stream );
+    }
+
+    unschedule_stream ( proxy, stream );
+    untouch_stream ( proxy, stream );
+
+    /* Neighbour must not point to a released slot */
+    if ( stream->neighbour && stream->neighbour->neighbour == stream )
+    {
+        stream->neighbour->neighbour = NULL;
     }
 
     if ( stream == proxy->stream_head )
@@ -1047,7 +1787,11 @@ void remove_stream ( struct proxy_t *proxy, struct stream_t *stream )
         stream->prev->next = stream->next;
     }
 
+    /* Slot goes back to the free list */
     stream->allocated = 0;
+    stream->next = proxy->stream_free;
+    proxy->stream_free = stream;
+    proxy->stream_count--;
 
     show_stats ( proxy );
 }
@@ -1082,6 +1826,27 @@ void remove_all_streams ( struct proxy_t *proxy )
     }
 }
 
+/**
+ * Free stream slab memory
+ */
+void free_streams ( struct proxy_t *proxy )
+{
+    struct stream_chunk_t *chunk;
+
+    while ( ( chunk = proxy->stream_chunks ) )
+    {
+        proxy->stream_chunks = chunk->next;
+        free ( chunk );
+    }
+
+    free ( proxy->poll_list );
+
+    proxy->stream_free = NULL;
+    proxy->stream_capacity = 0;
+    proxy->poll_list = NULL;
+    proxy->poll_size = 0;
+}
+
 /**
  * Remove pending streams
  */
@@ -1096,6 +1861,7 @@ static void remove_pending_streams ( struct proxy_t *proxy )
         {
             verbose ( "cleaning up pending stream with socket:%i...\n", iter->fd );
             remove_relation ( iter );
+            schedule_stream ( proxy, iter );
         }
     }
 }
@@ -1108,9 +1874,10 @@ static void cleanup_streams ( struct proxy_t *proxy )
     struct stream_t *iter;
     struct stream_t *next;
 
-    for ( iter = proxy->stream_head; iter; iter = next )
+    /* Abandoned streams are always on the ready list */
+    for ( iter = proxy->ready_head; iter; iter = next )
     {
-        next = iter->next;
+        next = iter->ready_next;
 
         if ( iter->abandoned )
         {
@@ -1120,29 +1887,39 @@ static void cleanup_streams ( struct proxy_t *proxy )
 }
 
 /**
- * Remove oldest forwarding relation
+ * Remove least recently active relation
  */
 void force_cleanup ( struct proxy_t *proxy, const struct stream_t *excl )
 {
     struct stream_t *iter;
 
-    for ( iter = proxy->stream_tail; iter; iter = iter->prev )
+    /* Abandoned streams are always on the ready list */
+    for ( iter = proxy->ready_head; iter; iter = iter->ready_next )
     {
         if ( iter != excl && iter->abandoned )
         {
             verbose ( "will remove an abandoned stream with socket:%i...\n", iter->fd );
             remove_relation ( iter );
+            if ( iter->neighbour )
+            {
+                schedule_stream ( proxy, iter->neighbour );
+            }
             remove_stream ( proxy, iter );
             return;
         }
     }
 
-    for ( iter = proxy->stream_tail; iter; iter = iter->prev )
+    /* Relations are ordered by last transfer, idle ones are at the tail */
+    for ( iter = proxy->lru_tail; iter; iter = iter->lru_prev )
     {
-        if ( iter != excl && ( iter->role == S_PORT_A || iter->role == S_PORT_B ) )
+        if ( iter != excl && iter->neighbour != excl )
         {
-            verbose ( "need to get rid of stream with socket:%i...\n", iter->fd );
+            verbose ( "need to get rid of least active stream with socket:%i...\n", iter->fd );
             remove_relation ( iter );
+            if ( iter->neighbour )
+            {
+                schedule_stream ( proxy, iter->neighbour );
+            }
             remove_stream ( proxy, iter );
             return;
         }
@@ -1155,8 +1932,8 @@ void force_cleanup ( struct proxy_t *proxy, const struct stream_t *excl )
 int handle_streams_cycle ( struct proxy_t *proxy )
 {
     int status;
+    size_t count;
     struct stream_t *iter;
-    struct stream_t *next;
 
     /* Cleanup streams */
     cleanup_streams ( proxy );
@@ -1176,27 +1953,53 @@ int handle_streams_cycle ( struct proxy_t *proxy )
         return 0;
     }
 
-    /* Process stream list */
-    for ( iter = proxy->stream_head; iter; iter = next )
+    /* Process only streams with pending work */
+    for ( count = proxy->ready_len; count && ( iter = proxy->ready_head ); count-- )
     {
-        next = iter->next;
+        unschedule_stream ( proxy, iter );
 
-        if ( !iter->abandoned && iter->revents )
+        if ( iter->abandoned )
         {
-            if ( iter->revents & ( POLLERR | POLLHUP ) )
-            {
-                verbose ( "stream with socket:%i got POLLERR/POLLHUP...\n", iter->fd );
-                remove_relation ( iter );
+            remove_stream ( proxy, iter );
+            continue;
+        }
 
-            } else
+        iter->revents = iter->lrevents & ( iter->events | POLLERR | POLLHUP );
+
+        if ( iter->revents & POLLERR || ( iter->revents & POLLHUP
+                && iter->level != LEVEL_FORWARDING ) )
+        {
+            verbose ( "stream with socket:%i got POLLERR/POLLHUP...\n", iter->fd );
+            remove_relation ( iter );
+
+        } else if ( iter->revents )
+        {
+            /* Hang-up of a half-closed stream still leaves data and end of stream to read */
+            stream_would_block ( iter, POLLHUP );
+
+            if ( handle_stream_events ( proxy, iter ) < 0 )
             {
-                if ( handle_stream_events ( proxy, iter ) < 0 )
-                {
-                    return -1;
-                }
+                return -1;
             }
         }
+
+        /* Poll is level-triggered, readiness is reported again */
+        if ( proxy->epoll_fd < 0 && !proxy->uring )
+        {
+            iter->lrevents = 0;
+        }
+
+        /* Handlers only change events of the stream and its neighbour */
+        reschedule_stream ( proxy, iter );
+
+        if ( iter->neighbour )
+        {
+            reschedule_stream ( proxy, iter->neighbour );
+        }
     }
 
+    /* Slots of relations closed in this cycle are free for new ones */
+    cleanup_streams ( proxy );
+
     return 0;
 }
@@ -0,0 +1,637 @@
+/* ------------------------------------------------------------------
+ * SocksCrypt - Worker Threads Source Code
+ * ------------------------------------------------------------------ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+
+#include "worker.h"
+#include "ktls.h"
+#include "coalesce.h"
+#include "timer.h"
+
+/**
+ * Worker thread entry point
+ */
+static void *worker_main ( void *arg )
+{
+    struct proxy_t *proxy;
+    struct worker_t *worker = ( struct worker_t * ) arg;
+
+    worker->status = -1;
+
+    /* State is first touched on the pinned core, so it lands on the local NUMA node */
+    if ( ( errno =
+            posix_memalign ( ( void ** ) &proxy, SC_CACHELINE, sizeof ( struct proxy_t ) ) ) != 0 )
+    {
+        failure ( "cannot allocate worker %i state (%i)\n", worker->index, errno );
+        return NULL;
+    }
+
+    memcpy ( proxy, worker->params, sizeof ( struct proxy_t ) );
+    proxy->listen_sock = worker->listen_sock;
+    proxy->worker = worker->balance ? worker : NULL;
+
+    /* Each worker seeds its own random generator */
+    if ( sc_init ( &proxy->sc_context, worker->params->sc_context.aeskey,
+            sizeof ( worker->params->sc_context.aeskey ) ) < 0 )
+    {
+        failure ( "crypto setup failed for worker %i\n", worker->index );
+        free ( proxy );
+        return NULL;
+    }
+
+    proxy->sc_context.ring_size = worker->params->sc_context.ring_size;
+    proxy->sc_context.aead = worker->params->sc_context.aead;
+    proxy->sc_context.chunk_len = worker->params->sc_context.chunk_len;
+    proxy->sc_context.coalesce_usec = worker->params->sc_context.coalesce_usec;
+    proxy->sc_context.coalesce_bytes = worker->params->sc_context.coalesce_bytes;
+
+    /* Engine was picked once at startup */
+    sc_engine_select ( &proxy->sc_context, worker->params->sc_context.engine );
+
+    worker->status = proxy_task ( proxy );
+
+    sc_free ( &proxy->sc_context );
+    free ( proxy );
+
+    return NULL;
+}
+
+/**
+ * Register worker hand-off queue with the proxy
+ */
+int worker_attach ( struct proxy_t *proxy )
+{
+    struct stream_t *stream;
+    struct worker_t *worker = proxy->worker;
+
+    if ( !( stream = insert_stream ( proxy, worker->handoff_fd ) ) )
+    {
+        return -1;
+    }
+
+    stream->role = L_HANDOFF;
+    stream->events = POLLIN;
+    worker->handoff_stream = stream;
+
+    clock_gettime ( CLOCK_MONOTONIC, &worker->last_tick );
+    __atomic_store_n ( &worker->alive, 1, __ATOMIC_RELEASE );
+
+    return 0;
+}
+
+/**
+ * Unregister worker hand-off queue from the proxy
+ */
+void worker_detach ( struct proxy_t *proxy )
+{
+    struct worker_t *worker = proxy->worker;
+
+    __atomic_store_n ( &worker->alive, 0, __ATOMIC_RELEASE );
+
+    /* Event fd is closed once all workers are joined */
+    if ( worker->handoff_stream )
+    {
+        worker->handoff_stream->fd = -1;
+        worker->handoff_stream = NULL;
+    }
+}
+
+/**
+ * Take over a single relation
+ */
+static int worker_adopt_relation ( struct proxy_t *proxy, struct handoff_t *handoff )
+{
+    int i;
+    struct stream_t *pair[2] = { NULL, NULL };
+
+    /* Relation is dropped if this worker is at its stream limit or cannot watch it */
+    if ( reserve_streams ( proxy, 2 ) < 0
+        || !( pair[0] = insert_stream ( proxy, handoff->pair[0].fd ) )
+        || !( pair[1] = insert_stream ( proxy, handoff->pair[1].fd ) ) )
+    {
+        failure ( "cannot adopt relation of socket:%i and socket:%i\n", handoff->pair[0].fd,
+            handoff->pair[1].fd );
+
+        for ( i = 0; i < 2; i++ )
+        {
+            /* Inserted stream has no state yet, removing it closes the socket */
+            if ( pair[i] )
+            {
+                remove_stream ( proxy, pair[i] );
+
+            } else
+            {
+                shutdown_then_close ( proxy, handoff->pair[i].fd );
+            }
+
+            ktls_release ( &handoff->pair[i] );
+            sc_free_stream ( &handoff->pair[i].sc );
+        }
+        return -1;
+    }
+
+    for ( i = 0; i < 2; i++ )
+    {
+        pair[i]->role = handoff->pair[i].role;
+        pair[i]->level = handoff->pair[i].level;
+        pair[i]->events = handoff->pair[i].events;
+        pair[i]->nsyscalls = handoff->pair[i].nsyscalls;
+        pair[i]->nbytes = handoff->pair[i].nbytes;
+        pair[i]->nbytes_mark = handoff->pair[i].nbytes;
+        memcpy ( &pair[i]->sc, &handoff->pair[i].sc, sizeof ( struct sc_stream_t ) );
+
+        /* Kernel TLS keys stay with the socket, splice pipe moves along */
+        pair[i]->ktls = handoff->pair[i].ktls;
+        pair[i]->hello_len = handoff->pair[i].hello_len;
+        memcpy ( pair[i]->hello, handoff->pair[i].hello, sizeof ( pair[i]->hello ) );
+        pair[i]->splice_fds[0] = handoff->pair[i].splice_fds[0];
+        pair[i]->splice_fds[1] = handoff->pair[i].splice_fds[1];
+        pair[i]->splice_len = handoff->pair[i].splice_len;
+        pair[i]->corked = handoff->pair[i].corked;
+        pair[i]->eof = handoff->pair[i].eof;
+        pair[i]->shut = handoff->pair[i].shut;
+
+        /* Requests were cancelled before the hand-off, finished ones are accounted here */
+        pair[i]->uring_done = handoff->pair[i].uring_done;
+        pair[i]->uring_recv_res = handoff->pair[i].uring_recv_res;
+        pair[i]->uring_send_res = handoff->pair[i].uring_send_res;
+        pair[i]->uring_recv_buf = handoff->pair[i].uring_recv_buf;
+        pair[i]->lrevents |= ( pair[i]->uring_done & URING_OP_RECV ? POLLIN : 0 )
+            | ( pair[i]->uring_done & URING_OP_SEND ? POLLOUT : 0 );
+
+        /* Key schedule is the same, nonce pool is local */
+        pair[i]->sc.context = &proxy->sc_context;
+    }
+
+    pair[0]->neighbour = pair[1];
+    pair[1]->neighbour = pair[0];
+
+    for ( i = 0; i < 2; i++ )
+    {
+        if ( pair[i]->uring_done )
+        {
+            schedule_stream ( proxy, pair[i] );
+        }
+    }
+
+    /* Held small reads wait for this worker's timer */
+    coalesce_track ( proxy, pair[0] );
+    coalesce_track ( proxy, pair[1] );
+
+    /* Idle timeout starts over on this worker */
+    timer_track ( proxy, pair[0] );
+    touch_stream ( proxy, pair[0] );
+
+    verbose ( "adopted relation of socket:%i and socket:%i\n", pair[0]->fd, pair[1]->fd );
+
+    return 0;
+}
+
+/**
+ * Adopt relations handed off by other workers
+ */
+int worker_adopt ( struct proxy_t *proxy, struct stream_t *stream )
+{
+    uint64_t count;
+    struct handoff_t *next;
+    struct handoff_t *handoff;
+    struct handoff_t *list = NULL;
+
+    if ( ~stream->revents & POLLIN )
+    {
+        return -1;
+    }
+
+    /* Reading resets the counter, so the event fd is drained */
+    if ( read ( stream->fd, &count, sizeof ( count ) ) < 0 && errno != EAGAIN )
+    {
+        failure ( "cannot read hand-off event (%i)\n", errno );
+        return -1;
+    }
+
+    stream_would_block ( stream, POLLIN );
+
+    /* Take whole stack at once, then restore hand-off order */
+    handoff = __atomic_exchange_n ( &proxy->worker->handoff_head, NULL, __ATOMIC_ACQUIRE );
+
+    while ( handoff )
+    {
+        next = handoff->next;
+        handoff->next = list;
+        list = handoff;
+        handoff = next;
+    }
+
+    while ( ( handoff = list ) )
+    {
+        list = handoff->next;
+        /* Dropped relation does not stop the others */
+        worker_adopt_relation ( proxy, handoff );
+        free ( handoff );
+    }
+
+    return 0;
+}
+
+/**
+ * Hand off relation to another worker
+ */
+static int worker_handoff ( struct proxy_t *proxy, struct worker_t *target,
+    struct stream_t *stream )
+{
+    int i;
+    uint64_t one = 1;
+    struct handoff_t *handoff;
+    struct stream_t *pair[2];
+
+    if ( !( handoff = malloc ( sizeof ( struct handoff_t ) ) ) )
+    {
+        return -1;
+    }
+
+    pair[0] = stream;
+    pair[1] = stream->neighbour;
+
+    for ( i = 0; i < 2; i++ )
+    {
+        unwatch_stream ( proxy, pair[i] );
+        coalesce_release ( proxy, pair[i] );
+        timer_release ( pair[i] );
+
+        memcpy ( &handoff->pair[i], pair[i], sizeof ( struct stream_t ) );
+
+        /* Socket and crypto state now belong to the copy */
+        pair[i]->fd = -1;
+        pair[i]->nbytes = 0;
+        pair[i]->ktls = 0;
+        memset ( &pair[i]->sc, '\0', sizeof ( struct sc_stream_t ) );
+    }
+
+    remove_stream ( proxy, pair[0] );
+    remove_stream ( proxy, pair[1] );
+
+    /* Lock-free push, target takes the whole stack at once */
+    handoff->next = __atomic_load_n ( &target->handoff_head, __ATOMIC_RELAXED );
+
+    while ( !__atomic_compare_exchange_n ( &target->handoff_head, &handoff->next, handoff, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED ) )
+    {
+    }
+
+    if ( write ( target->handoff_fd, &one, sizeof ( one ) ) < 0 )
+    {
+        failure ( "cannot signal worker %i (%i)\n", target->index, errno );
+    }
+
+    verbose ( "handed off relation of socket:%i and socket:%i to worker %i\n",
+        handoff->pair[0].fd, handoff->pair[1].fd, target->index );
+
+    return 0;
+}
+
+/**
+ * Hand off busiest relation if this worker is overloaded
+ */
+void worker_rebalance ( struct proxy_t *proxy )
+{
+    int i;
+    long msec;
+    unsigned long rate;
+    unsigned long peer_rate;
+    unsigned long target_rate = 0;
+    unsigned long long delta;
+    unsigned long long best_delta = 0;
+    struct timespec now;
+    struct stream_t *iter;
+    struct stream_t *best = NULL;
+    struct worker_t *target = NULL;
+    struct worker_t *worker = proxy->worker;
+
+    clock_gettime ( CLOCK_MONOTONIC, &now );
+
+    msec = ( now.tv_sec - worker->last_tick.tv_sec ) * 1000
+        + ( now.tv_nsec - worker->last_tick.tv_nsec ) / 1000000;
+
+    if ( msec < REBALANCE_INTERVAL_MSEC )
+    {
+        return;
+    }
+
+    /* Publish own byte rate */
+    rate = ( proxy->nbytes - worker->last_bytes ) * 1000 / msec;
+    worker->last_bytes = proxy->nbytes;
+    worker->last_tick = now;
+    __atomic_store_n ( &worker->rate, rate, __ATOMIC_RELAXED );
+
+    /* Find busiest relation over the last interval */
+    for ( iter = proxy->stream_head; iter; iter = iter->next )
+    {
+        if ( iter->role == S_PORT_A )
+        {
+            delta = iter->nbytes - iter->nbytes_mark;
+            iter->nbytes_mark = iter->nbytes;
+
+            /* Pipelined relations stay with their crypto threads */
+            if ( delta > best_delta && iter->neighbour && !iter->abandoned
+                && iter->level == LEVEL_FORWARDING && !iter->pipe && !iter->neighbour->pipe )
+            {
+                best_delta = delta;
+                best = iter;
+            }
+        }
+    }
+
+    if ( !best || rate < REBALANCE_MIN_RATE )
+    {
+        return;
+    }
+
+    /* Find least loaded worker */
+    for ( i = 0; i < worker->nworkers; i++ )
+    {
+        if ( &worker->group[i] != worker
+            && __atomic_load_n ( &worker->group[i].alive, __ATOMIC_ACQUIRE ) )
+        {
+            peer_rate = __atomic_load_n ( &worker->group[i].rate, __ATOMIC_RELAXED );
+
+            if ( !target || peer_rate < target_rate )
+            {
+                target = &worker->group[i];
+                target_rate = peer_rate;
+            }
+        }
+    }
+
+    /* Move only if target stays below this worker afterwards */
+    if ( target && rate > 2 * target_rate
+        && target_rate + best_delta * 1000 / msec < rate )
+    {
+        verbose ( "worker %i at %lu B/s, worker %i at %lu B/s\n", worker->index, rate,
+            target->index, target_rate );
+
+        if ( worker_handoff ( proxy, target, best ) < 0 )
+        {
+            failure ( "cannot hand off relation of socket:%i\n", best->fd );
+        }
+    }
+}
+
+/**
+ * Steer connections to the worker on the receiving cpu
+ */
+static void worker_steering ( struct proxy_t *proxy, struct worker_t *workers, int nworkers,
+    int ncpus )
+{
+    int i;
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    int len = 0;
+    struct sock_filter code[2 * WORKERS_MAX + 3];
+    struct sock_fprog prog;
+#endif
+
+    /* Workers sharing a cpu cannot be told apart by the receiving cpu */
+    if ( nworkers > ncpus )
+    {
+        verbose ( "more workers than cpus, steering connections by hash\n" );
+        return;
+    }
+
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    code[len++] =
+        ( struct sock_filter ) BPF_STMT ( BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU );
+
+    /* Each pinned cpu maps to its worker, cpu ids need not be contiguous */
+    for ( i = 0; i < nworkers; i++ )
+    {
+        code[len++] =
+            ( struct sock_filter ) BPF_JUMP ( BPF_JMP | BPF_JEQ | BPF_K, workers[i].cpu, 0, 1 );
+        code[len++] = ( struct sock_filter ) BPF_STMT ( BPF_RET | BPF_K, i );
+    }
+
+    /* Cpus without a worker spread over all of them */
+    code[len++] = ( struct sock_filter ) BPF_STMT ( BPF_ALU | BPF_MOD | BPF_K, nworkers );
+    code[len++] = ( struct sock_filter ) BPF_STMT ( BPF_RET | BPF_A, 0 );
+
+    prog.len = len;
+    prog.filter = code;
+
+    /* Program selects group member by bind order, i.e. by worker index */
+    if ( setsockopt ( workers[0].listen_sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+            sizeof ( prog ) ) >= 0 )
+    {
+        verbose ( "steering connections by receiving cpu with bpf\n" );
+        return;
+    }
+#endif
+
+#ifdef SO_INCOMING_CPU
+    for ( i = 0; i < nworkers; i++ )
+    {
+        if ( setsockopt ( workers[i].listen_sock, SOL_SOCKET, SO_INCOMING_CPU, &workers[i].cpu,
+                sizeof ( workers[i].cpu ) ) < 0 )
+        {
+            break;
+        }
+    }
+
+    if ( i == nworkers )
+    {
+        verbose ( "steering connections by receiving cpu with incoming cpu hint\n" );
+        return;
+    }
+#endif
+
+    UNUSED ( i );
+    verbose ( "steering connections by hash\n" );
+}
+
+/**
+ * Start worker thread, pinned to a core if requested
+ */
+static int worker_start ( struct proxy_t *proxy, struct worker_t *worker )
+{
+    int status;
+    cpu_set_t cpuset;
+    pthread_attr_t attr;
+
+    if ( ( status = pthread_attr_init ( &attr ) ) != 0 )
+    {
+        errno = status;
+        return -1;
+    }
+
+    if ( worker->cpu >= 0 )
+    {
+        CPU_ZERO ( &cpuset );
+        CPU_SET ( worker->cpu, &cpuset );
+
+        if ( ( status = pthread_attr_setaffinity_np ( &attr, sizeof ( cpuset ), &cpuset ) ) != 0 )
+        {
+            pthread_attr_destroy ( &attr );
+            errno = status;
+            return -1;
+        }
+    }
+
+    status = pthread_create ( &worker->thread, &attr, worker_main, worker );
+    pthread_attr_destroy ( &attr );
+
+    if ( status != 0 )
+    {
+        errno = status;
+        return -1;
+    }
+
+    verbose ( "worker %i started on cpu %i\n", worker->index, worker->cpu );
+
+    return 0;
+}
+
+/**
+ * Release workers and relations left in their hand-off queues
+ */
+static void worker_cleanup ( struct proxy_t *proxy, struct worker_t *workers, int nworkers )
+{
+    int i;
+    int j;
+    struct handoff_t *handoff;
+
+    for ( i = 0; i < nworkers; i++ )
+    {
+        while ( ( handoff = workers[i].handoff_head ) )
+        {
+            workers[i].handoff_head = handoff->next;
+
+            for ( j = 0; j < 2; j++ )
+            {
+                shutdown_then_close ( proxy, handoff->pair[j].fd );
+                ktls_release ( &handoff->pair[j] );
+                sc_free_stream ( &handoff->pair[j].sc );
+            }
+
+            free ( handoff );
+        }
+
+        if ( workers[i].listen_sock >= 0 )
+        {
+            shutdown_then_close ( proxy, workers[i].listen_sock );
+        }
+
+        if ( workers[i].handoff_fd >= 0 )
+        {
+            close ( workers[i].handoff_fd );
+        }
+    }
+
+    free ( workers );
+}
+
+/**
+ * Run proxy task in parallel worker threads
+ */
+int proxy_workers ( struct proxy_t *params, int nworkers, int pin, int balance )
+{
+    int i;
+    int ncpus = 0;
+    int nstarted;
+    int status = 0;
+    int cpus[CPU_SETSIZE];
+    cpu_set_t cpuset;
+    struct worker_t *workers;
+    struct proxy_t *proxy = params;
+
+    /* Workers are cache-aligned, hand-off fields are written across threads */
+    if ( ( errno =
+            posix_memalign ( ( void ** ) &workers, SC_CACHELINE,
+                nworkers * sizeof ( struct worker_t ) ) ) != 0 )
+    {
+        failure ( "cannot allocate workers (%i)\n", errno );
+        return -1;
+    }
+
+    memset ( workers, '\0', nworkers * sizeof ( struct worker_t ) );
+
+    /* Workers are pinned to the cpus this process may run on */
+    if ( sched_getaffinity ( 0, sizeof ( cpuset ), &cpuset ) == 0 )
+    {
+        for ( i = 0; i < CPU_SETSIZE; i++ )
+        {
+            if ( CPU_ISSET ( i, &cpuset ) )
+            {
+                cpus[ncpus++] = i;
+            }
+        }
+    }
+
+    if ( !ncpus )
+    {
+        cpus[ncpus++] = 0;
+    }
+
+    params->reuse_port = 1;
+
+    /* Listeners are bound in worker order, which reuseport group indexes follow */
+    for ( i = 0; i < nworkers; i++ )
+    {
+        workers[i].index = i;
+        workers[i].cpu = pin ? cpus[i % ncpus] : -1;
+        workers[i].balance = balance && nworkers > 1;
+        workers[i].nworkers = nworkers;
+        workers[i].group = workers;
+        workers[i].params = params;
+        workers[i].handoff_fd = -1;
+
+        if ( workers[i].balance
+            && ( workers[i].handoff_fd = eventfd ( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ) < 0 )
+        {
+            failure ( "cannot create hand-off event (%i)\n", errno );
+            worker_cleanup ( params, workers, i );
+            return -1;
+        }
+
+        if ( ( workers[i].listen_sock = listen_socket ( params, &params->entrance ) ) < 0 )
+        {
+            worker_cleanup ( params, workers, i + 1 );
+            return -1;
+        }
+    }
+
+    if ( pin )
+    {
+        worker_steering ( params, workers, nworkers, ncpus );
+    }
+
+    /* Workers share nothing but the listen port */
+    for ( nstarted = 0; nstarted < nworkers; nstarted++ )
+    {
+        if ( worker_start ( proxy, &workers[nstarted] ) < 0 )
+        {
+            failure ( "cannot start worker %i (%i)\n", nstarted, errno );
+            status = -1;
+            break;
+        }
+    }
+
+    for ( i = 0; i < nstarted; i++ )
+    {
+        pthread_join ( workers[i].thread, NULL );
+
+        /* Listener was owned and closed by the worker */
+        workers[i].listen_sock = -1;
+
+        if ( workers[i].status < 0 )
+        {
+            failure ( "worker %i exited with error\n", i );
+            status = -1;
+        }
+    }
+
+    worker_cleanup ( params, workers, nworkers );
+
+    return status;
+}
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+# ------------------------------------------------------------------
+# SocksCrypt - Kernel TLS Loopback Test
+# ------------------------------------------------------------------
+# Runs a -t peer against a peer without -t over loopback, both ways round,
+# and checks data in both directions plus end of stream. Without the tls
+# kernel module the -t peer must fall back to userspace crypto.
+
+import os
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+BIN = os.environ.get("SOCKSCRYPT",
+    os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "bin", "sockscrypt"))
+NCONN = 8
+BANNER = os.urandom(300000)
+
+
+def free_port():
+    s = socket.socket()
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def endpoint(sock):
+    """Send a banner first, then echo until the peer half-closes"""
+    while True:
+        conn, _ = sock.accept()
+
+        def serve(conn):
+            conn.sendall(BANNER)
+            while True:
+                data = conn.recv(65536)
+                if not data:
+                    break
+                conn.sendall(data)
+            conn.close()
+
+        threading.Thread(target=serve, args=(conn,), daemon=True).start()
+
+
+def relation(port, results, index):
+    data = os.urandom(200000 + index)
+    got = bytearray()
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.settimeout(10)
+    reader = threading.Thread(target=lambda: read_all(sock, got))
+    reader.start()
+    sock.sendall(data)
+    sock.shutdown(socket.SHUT_WR)
+    reader.join()
+    sock.close()
+    results[index] = bytes(got) == BANNER + data
+
+
+def read_all(sock, got):
+    try:
+        while True:
+            data = sock.recv(1 << 20)
+            if not data:
+                return
+            got.extend(data)
+    except OSError:
+        got.extend(b"timeout")
+
+
+def run(keyfile, client_flags, server_flags, endp_port):
+    srv_port = free_port()
+    cli_port = free_port()
+    logs = [tempfile.TemporaryFile(), tempfile.TemporaryFile()]
+    procs = [
+        subprocess.Popen([BIN, "-sv" + server_flags, keyfile, "127.0.0.1:%d" % srv_port,
+            "127.0.0.1:%d" % endp_port], stdout=logs[0], stderr=subprocess.STDOUT),
+        subprocess.Popen([BIN, "-cv" + client_flags, keyfile, "127.0.0.1:%d" % cli_port,
+            "127.0.0.1:%d" % srv_port], stdout=logs[1], stderr=subprocess.STDOUT)]
+    time.sleep(0.5)
+
+    results = {}
+    threads = [threading.Thread(target=relation, args=(cli_port, results, i))
+        for i in range(NCONN)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    for p in procs:
+        p.kill()
+        p.wait()
+
+    text = b""
+    for log in logs:
+        log.seek(0)
+        text += log.read()
+
+    if b"kernel tls sending" in text:
+        mode = "kernel tls"
+    elif b"kernel tls unavailable" in text:
+        mode = "userspace fallback"
+    else:
+        mode = "no kernel tls attempt"
+
+    ok = len(results) == NCONN and all(results.values()) and mode != "no kernel tls attempt"
+    print("client -c%s server -s%s: %s, %s" % (client_flags, server_flags, mode,
+        "ok" if ok else "FAILED %s" % results))
+    return ok
+
+
+def main():
+    if not os.access(BIN, os.X_OK):
+        print("%s not built" % BIN)
+        return 1
+
+    endp = socket.socket()
+    endp.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    endp.bind(("127.0.0.1", 0))
+    endp.listen(64)
+    threading.Thread(target=endpoint, args=(endp,), daemon=True).start()
+
+    with tempfile.NamedTemporaryFile() as key:
+        key.write(os.urandom(32))
+        key.flush()
+        ok = run(key.name, "t", "", endp.getsockname()[1])
+        ok &= run(key.name, "", "t", endp.getsockname()[1])
+
+    print("PASS" if ok else "FAIL")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())